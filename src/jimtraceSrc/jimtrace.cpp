@@ -0,0 +1,165 @@
+/**
+ * @file jimtrace.cpp
+ * @brief Prints an execution trace written by jimulator's -t option, oldest
+ * first, with each instruction's source text from the program's .kmd file.
+ * Usage: jimtrace [-n last] trace [file.kmd]
+ */
+
+#include "../jimulatorSrc/trace.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <unordered_map>
+
+// Local prototypes
+const std::unordered_map<uint32_t, std::string> readListing(const char*);
+void printRecord(uint64_t, const traceRecord*,
+                 const std::unordered_map<uint32_t, std::string>&);
+
+/**
+ * @brief Program entry point.
+ * @return int Exit code.
+ */
+int main(int argc, char** argv) {
+  uint64_t last = 0;  // All that the ring holds
+  int option;
+
+  while ((option = getopt(argc, argv, "n:")) != -1) {
+    if (option == 'n') {
+      last = strtoull(optarg, NULL, 0);
+    } else {
+      argc = 0;
+    }
+  }
+
+  if ((argc - optind < 1) || (argc - optind > 2)) {
+    fprintf(stderr, "usage: %s [-n last records] trace [file.kmd]\n",
+            argv[0]);
+    return 1;
+  }
+
+  const int fd = open(argv[optind], O_RDONLY);
+  struct stat status;
+
+  if ((fd < 0) || (fstat(fd, &status) != 0)) {
+    perror(argv[optind]);
+    return 1;
+  }
+  if ((size_t)status.st_size < sizeof(traceHeader)) {
+    fprintf(stderr, "%s: not a trace file\n", argv[optind]);
+    return 1;
+  }
+
+  void* mapped = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  const traceHeader* header = (const traceHeader*)mapped;
+  const traceRecord* ring = (const traceRecord*)(header + 1);
+
+  if ((memcmp(header->magic, traceMagic, sizeof(traceMagic)) != 0) ||
+      (header->version != traceVersion) ||
+      (header->recordSize != sizeof(traceRecord)) ||
+      (header->capacity == 0) ||
+      ((header->capacity & (header->capacity - 1)) != 0) ||
+      ((size_t)status.st_size < sizeof(traceHeader) + (size_t)header->capacity *
+                                                        sizeof(traceRecord))) {
+    fprintf(stderr, "%s: not a trace file, or from another version\n",
+            argv[optind]);
+    return 1;
+  }
+
+  const std::unordered_map<uint32_t, std::string> listing =
+      readListing((argc - optind == 2) ? argv[optind + 1] : NULL);
+  const uint64_t written = header->written;
+  uint64_t first = (written > header->capacity) ? written - header->capacity
+                                                : 0;  // Older are overwritten
+
+  if ((last != 0) && (written - first > last)) {
+    first = written - last;
+  }
+
+  for (uint64_t i = first; i < written; i++) {
+    printRecord(i, &ring[i & (header->capacity - 1)], listing);
+  }
+
+  munmap(mapped, status.st_size);
+  return 0;
+}
+
+/**
+ * @brief Reads the source text of each address from a .kmd file.
+ * @param pathToKMD NULL for none
+ * @return const std::unordered_map<uint32_t, std::string> Text by address;
+ * the first line at an address wins.
+ */
+const std::unordered_map<uint32_t, std::string> readListing(
+    const char* pathToKMD) {
+  std::unordered_map<uint32_t, std::string> listing;
+  FILE* kmd = (pathToKMD == NULL) ? NULL : fopen(pathToKMD, "r");
+  char line[0X400];
+
+  if ((kmd == NULL) && (pathToKMD != NULL)) {
+    perror(pathToKMD);
+  }
+
+  while ((kmd != NULL) && (fgets(line, sizeof(line), kmd) != NULL)) {
+    char* end;
+    const uint32_t address = strtoul(line, &end, 16);
+    char* source = strchr(line, ';');
+
+    if ((end != line) && (*end == ':') && (source != NULL) &&
+        (strspn(end + 1, " \t") != strcspn(end + 1, ";")) &&  // Has data
+        (listing.count(address) == 0)) {
+      source[strcspn(source, "\n")] = '\0';
+      listing[address] = (source[1] == ' ') ? source + 2 : source + 1;
+    }
+  }
+
+  if (kmd != NULL) {
+    fclose(kmd);
+  }
+  return listing;
+}
+
+/**
+ * @brief Prints one record: an instruction with its state (ARM or Thumb),
+ * the flags after it and its source text; or a memory write beneath the
+ * instruction that made it.
+ * @param number Position in the whole run
+ * @param record
+ * @param listing
+ */
+void printRecord(uint64_t number,
+                 const traceRecord* record,
+                 const std::unordered_map<uint32_t, std::string>& listing) {
+  if (record->kind == traceInstruction) {
+    const uint32_t cpsr = record->cpsr;
+    const bool thumb = (record->size == 2);
+    const auto source = listing.find(record->address);
+
+    printf("%10llu  %08X  %0*X%*s  %c%c%c%c %s  %s\n",
+           (unsigned long long)number, record->address, thumb ? 4 : 8,
+           record->value, thumb ? 4 : 0, "",
+           ((cpsr & 0X80000000) != 0) ? 'N' : 'n',
+           ((cpsr & 0X40000000) != 0) ? 'Z' : 'z',
+           ((cpsr & 0X20000000) != 0) ? 'C' : 'c',
+           ((cpsr & 0X10000000) != 0) ? 'V' : 'v',
+           thumb ? "T" : "A",
+           (source == listing.end()) ? "" : source->second.c_str());
+  } else if (record->kind == traceWrite) {
+    const uint32_t mask =
+        (record->size >= 4) ? 0XFFFFFFFF : (1U << (8 * record->size)) - 1;
+
+    printf("%10s  %08X <- %0*X\n", "", record->address, record->size * 2,
+           record->value & mask);
+  }
+}
@@ -4,18 +4,33 @@
  * @brief The emulator associated with KoMo2.
  * @version 1.6
  * @date 2021-06-27
- * @todo check long multiplications
  * @todo Flag checking (immediate ?!)
  * @todo Validation
  * @todo interrupt enable behaviour on exceptions (etc.)
  */
 
+#include "multiply.h"
+#include "trace.h"
+#include <elf.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/poll.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #define uchar unsigned char
 #define uint unsigned int
@@ -48,14 +63,21 @@ typedef enum {
   BR_PING = 0x01,
   BR_WOT_R_U = 0x02,
   BR_RESET = 0x04,
+  BR_SNAPSHOT = 0x06,
+  BR_RESTORE = 0x07,
   BR_FR_WRITE = 0x12,
   BR_FR_READ = 0x13,
+  BR_FR_READ_ALL = 0x14,
+  BR_SET_MEM_IMAGE = 0x60,
   BR_WOT_U_DO = 0x20,
   BR_STOP = 0x21,
   BR_PAUSE = 0x22,
   BR_CONTINUE = 0x23,
   BR_RTF_SET = 0x24,
   BR_RTF_GET = 0x25,
+  BR_PERF_GET = 0x26,
+  BR_PROFILE_SET = 0x27,
+  BR_PROFILE_GET = 0x28,
   BR_BP_WRITE = 0x30,
   BR_BP_READ = 0x31,
   BR_BP_SET = 0x32,
@@ -64,15 +86,29 @@ typedef enum {
   BR_WP_READ = 0x35,
   BR_WP_SET = 0x36,
   BR_WP_GET = 0x37,
+  BR_BP_SET_EXT = 0x38,
+  BR_BP_GET_EXT = 0x39,
 } BR_Instruction;
 
-#define NO_OF_BREAKPOINTS 32  // Max 32
-#define NO_OF_WATCHPOINTS 4   // Max 32
-#define RING_BUF_SIZE 64
+#define NO_OF_BREAKPOINTS 256  // Indexed by a byte; 32 per flag word
+#define NO_OF_WATCHPOINTS 32  // Max 32
+#ifndef RING_BUF_SIZE
+#define RING_BUF_SIZE 0X10000  // Bytes per terminal buffer; a power of 2
+#endif
 
+static_assert((RING_BUF_SIZE & (RING_BUF_SIZE - 1)) == 0,
+              "RING_BUF_SIZE must be a power of 2");
+
+// Every watchpoint available, one flag bit each
+constexpr const uint allWatchpoints =
+    (NO_OF_WATCHPOINTS >= 32) ? 0XFFFFFFFF : (1U << NO_OF_WATCHPOINTS) - 1;
+
+/* Used within one thread, the emulator and the monitor taking turns: the
+   indices run freely, each moved only by its own side, and are reduced
+   modulo the size on access. */
 typedef struct {
-  uint iHead;
-  uint iTail;
+  uint iHead;  // Bytes ever put
+  uint iTail;  // Bytes ever got
   uchar buffer[RING_BUF_SIZE];
 } ringBuffer;
 
@@ -81,21 +117,72 @@ struct pollfd pollfd;
 // Local prototypes
 
 void step();
-void comm(struct pollfd*);
+uint run();
+void runQuantum();
+void comm(struct pollfd*, int);
 
+struct Machine* newMachine();
 void emulSetup();
 void saveState(uchar);
 void initialise(uint, int);
-void execute(uint);
+
+// Batch mode
+
+typedef struct batchOptions batchOptions;
+typedef struct batchJob batchJob;
+
+int batchMain(int, char**);
+void batchWorker(batchJob*, int, int, std::atomic<int>*, const batchOptions*);
+void batchRun(batchJob*, const batchOptions*);
+bool loadProgram(const char*);
+bool loadKMD(const char*);
+bool loadELF(const uchar*, size_t);
+
+// Predecode
+
+typedef struct decodedInstruction decodedInstruction;
+typedef void (*instructionHandler)(const decodedInstruction*);
+
+void decode(uint, decodedInstruction*);
+void decodeARM(uint, decodedInstruction*);
+void decodeThumb(uint, decodedInstruction*);
+void execute(const decodedInstruction*);
+void invalidateDecodeCache(uint, uint);
+
+// Basic block engine
+
+typedef struct basicBlock basicBlock;
+
+bool blockEngineUsable();
+uint runBlocks(uint);
+basicBlock* lookupBlock(uint);
+void buildBlock(basicBlock*, uint, uchar);
+bool needsFallback(const decodedInstruction*);
+bool endsBlock(const decodedInstruction*);
+instructionHandler fusedHandlerFor(const decodedInstruction*);
+void flushBlocks();
+
+void setProfiling(bool);
+std::vector<std::pair<uint, uint>> hotSpots(uint);
+void profileReport(const char*, uint, std::string*);
+
+bool startTrace(const char*, uint);
+void stopTrace();
+traceRecord* nextTraceRecord();
+
+void takeSnapshot();
+int restoreSnapshot();
+void preservePages(uint, uint);
+void savePage(uint);
 
 // ARM execute
 
-void dataOp(uint);
+int isItSBHW(uint);
 void clz(uint);
 void transfer(uint);
 void transferSBHW(uint);
 void multiple(uint);
-void branch(uint);
+void branch(const decodedInstruction*);
 void mySystem(uint);
 void undefined();
 void breakpoint();
@@ -105,50 +192,86 @@ void msr(uint);
 void bx(uint, int);
 void myMulti(uint);
 void swap(uint);
-void normalDataOp(uint, int);
+template <uint, uint, bool>
+void normalDataOp(const decodedInstruction*);
+template <uint>
+uint shiftedRegister(uint, int*);
 void ldm(int, int, int, bool, bool);
 void stm(int, int, int, bool, bool);
 
+bool checkBreakpoint(uint, uint);
+bool breakpointMatches(int, uint, uint);
+void indexBreakpoints();
+void setBreakpointFlags(int);
 int checkWatchpoints(uint, int, int, int);
+uint watchedAt(uint);
+void indexWatchpoints();
 int transferOffset(int, int, int, bool);
 
 int bReg(int, int*);
-int bImmediate(int, int*);
 
-int bitCount(uint, int*);
+bool directTransfer(uint, uint, bool);
 bool checkCC(int);
-
-constexpr const bool zf(const int);
-constexpr const bool cf(const int);
-constexpr const bool nf(const int);
-constexpr const bool vf(const int);
+bool checkPendingCC(int);
 
 void setFlags(int, int, int, int, int);
 void setNZ(uint);
 void setCF(uint, uint, int);
 void setVF_ADD(int, int, int);
 void setVF_SUB(int, int, int);
+void materialiseFlags();
+bool carryFlag();
+void setCarry(bool);
 int getRegister(int, int);
 /* Returns PC+4 for ARM & PC+2 for Thumb */
 int getRegisterMonitor(int, int);
 void putRegister(int, int, int);
-constexpr const int instructionLength(const int, const int);
-
-uint fetch();
+void setCPSR(uint);
+void switchBank(uint, uint);
+int* bankedRegister(int, uint);
+int* registerFor(int, uint);
+uint forcedMode(int);
+constexpr uint registerBank(const uint);
+constexpr int instructionLength(const int, const int);
+
+const decodedInstruction* fetch();
+void noteFetchAddress(uint);
 void incPC();
 void endianSwap(uint, uint);
 int readMemory(uint, int, bool, bool, int);
 void writeMemory(uint, int, int, bool, int);
 
 /* THUMB execute */
-void data0(uint);
-void data1(uint);
-void dataTransfer(uint);
-void transfer0(uint);
-void transfer1(uint);
-void spPC(uint);
-void lsmB(uint);
-void thumbBranch(uint);
+template <uint>
+void thumbShiftImmediate(const decodedInstruction*);
+template <bool, bool>
+void thumbAddSub(const decodedInstruction*);
+template <uint>
+void thumbImmediate(const decodedInstruction*);
+template <uint>
+void thumbDataOp(const decodedInstruction*);
+template <uint>
+void thumbHighRegister(const decodedInstruction*);
+void thumbLoadLiteral(const decodedInstruction*);
+template <uint>
+void thumbTransferRegister(const decodedInstruction*);
+template <bool, int>
+void thumbTransferImmediate(const decodedInstruction*);
+template <bool>
+void thumbTransferSP(const decodedInstruction*);
+template <bool>
+void thumbAddress(const decodedInstruction*);
+template <bool>
+void thumbAdjustSP(const decodedInstruction*);
+template <bool>
+void thumbPushPop(const decodedInstruction*);
+template <bool>
+void thumbMultiple(const decodedInstruction*);
+void thumbBranch(const decodedInstruction*);
+void thumbSWI(const decodedInstruction*);
+void thumbBranchPrefix(const decodedInstruction*);
+template <bool>
+void thumbBranchSuffix(const decodedInstruction*);
 
 int loadFPE();
 void FPEInstall();
@@ -161,6 +284,9 @@ int ror(uint, int, int*);
 
 uint getmem32(int);
 void setmem32(int, uint);
+uint getmem16(int);
+void setmem16(int, uint);
+uint rotatedWord(uint);
 void executeInstruction();
 
 int getChar(uchar*);
@@ -176,6 +302,8 @@ void initBuffer(ringBuffer*);
 int countBuffer(ringBuffer*);
 bool putBuffer(ringBuffer*, const uchar);
 bool getBuffer(ringBuffer*, uchar*);
+uint putBufferBlock(ringBuffer*, const uchar*, uint);
+uint getBufferBlock(ringBuffer*, uchar*, uint);
 
 // Why add "RAMSIZE", and then get it wrong?!?!
 // Memory is modulo this to the monitor; excise and use the proper routines
@@ -185,7 +313,17 @@ constexpr const uint reserved_mem = 0X002000;  // 32 KB
 constexpr const uint userStack = (memSize - reserved_mem) << 2;
 constexpr const uint stackStringAddr = 0X00007000;  // ARM address
 
-constexpr const uint maxInstructions = 10000000;
+constexpr const uint maxInstructions = 10000000;  // Default batch limit
+constexpr const uint traceRecords = 0X100000;     // Default trace ring size
+
+constexpr const int batchHalted = 0;  // Batch mode exit statuses
+constexpr const int batchLimit = 1;
+constexpr const int batchStopped = 2;
+constexpr const int batchError = 3;
+
+constexpr const uint minQuantum = 16;  // Instructions between monitor polls
+constexpr const uint maxQuantum = 0X100000;
+constexpr const long quantumTargetNs = 2000000;  // Bounds command latency
 
 constexpr const uint nfMask = 0X80000000;
 constexpr const uint zfMask = 0X40000000;
@@ -199,6 +337,30 @@ constexpr const uint tfMask = 0X00000020;  // THUMB bit
 constexpr const uint bit31 = 0X80000000;
 constexpr const uint bit0 = 0X00000001;
 
+// Guest memory is little-endian; so is the host if words can be copied
+constexpr const bool littleEndianHost =
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+
+// Bit n set if the condition passes with NZCV = n (i.e. cpsr >> 28)
+constexpr const unsigned short conditionTable[16] = {
+    0XF0F0,  // EQ
+    0X0F0F,  // NE
+    0XCCCC,  // CS
+    0X3333,  // CC
+    0XFF00,  // MI
+    0X00FF,  // PL
+    0XAAAA,  // VS
+    0X5555,  // VC
+    0X0C0C,  // HI
+    0XF3F3,  // LS
+    0XAA55,  // GE
+    0X55AA,  // LT
+    0X0A05,  // GT
+    0XF5FA,  // LE
+    0XFFFF,  // AL
+    0X0000,  // NV
+};
+
 constexpr const uint immMask = 0X02000000;      // original word versions
 constexpr const uint immHwMask = 0X00400000;    // half word versions
 constexpr const uint dataOpMask = 0X01E00000;   // ALU function code
@@ -247,6 +409,7 @@ constexpr const int memSystem = 0;  // sources for memory read
 constexpr const int memInstruction = 1;
 constexpr const int memData = 2;
 
+constexpr const int flagNone = 0;  // Flag-setting operations
 constexpr const int flagAdd = 1;
 constexpr const int flagSub = 2;
 
@@ -278,6 +441,58 @@ typedef struct {
   int dataB[2];
 } BreakElement;
 
+constexpr const uchar decodedEmpty = 0;  // States of a predecode cache entry
+constexpr const uchar decodedARM = 1;
+constexpr const uchar decodedThumb = 2;
+
+constexpr const uint decodeCacheSize = 0X4000;  // Entries; power of 2
+
+constexpr const uchar carryUnchanged = 2;  // Shifter carry-out leaving C be
+constexpr const uint operandImmediate = 8;  // Data processing operand forms
+                                            // beyond those of bits 6:4
+
+/**
+ * @brief An op. code decoded once and kept in the predecode cache, along with
+ * the handler which executes it and the fields that handler needs.
+ */
+struct decodedInstruction {
+  uint address;       // Address fetched from (cache tag)
+  uchar state;        // decodedEmpty, decodedARM or decodedThumb
+  uchar cond;         // ARM or Thumb B (1) condition; AL for others and BLX
+  uchar rd, rn, rm;   // Register fields (ARM positions)
+  uchar operation;    // ALU function code for data processing
+  uchar shiftCarry;   // Immediate's carry-out: 0, 1 or carryUnchanged
+  int offset;         // Branch offset, pre-sign-extended; or data
+                      // processing immediate, pre-rotated
+  uint opCode;        // As fetched
+  instructionHandler handler;
+};
+
+constexpr const uint blockMaxLength = 32;    // Instructions per basic block
+constexpr const uint blockCacheSize = 0X400;  // Entries; power of 2
+constexpr const uint blockChainLimit = 16;    // Blocks run per monitor poll
+constexpr const uint codePageShift = 8;       // Granule of code write checks
+constexpr const uint watchPageShift = 8;      // Granule of the watchpoint map
+constexpr const uint snapshotPageShift = 12;  // Granule of snapshot copying
+constexpr const uint pastSize = 32;  // Op. code address history; power of 2
+constexpr const uint snapshotPages = memSize >> snapshotPageShift;
+
+/**
+ * @brief A run of straight-line instructions translated for the block engine.
+ * Execution leaves the block at its last instruction, or earlier if the PC,
+ * mode or Thumb state is not as the translation expected.
+ */
+struct basicBlock {
+  uint address;     // Start address (cache tag)
+  uchar state;      // As decodedInstruction
+  uint generation;  // Value of blockGeneration when built
+  uint length;
+  basicBlock* next[2];  // Successors seen: {fall through, taken}
+  instructionHandler fused;  // Runs the last two together, if not NULL
+  bool breakpoint[blockMaxLength];  // Breakpoint matches before this one
+  decodedInstruction instructions[blockMaxLength];
+};
+
 constexpr const uint WOTLEN_FEATURES = 1;
 constexpr const uint WOTLEN_MEM_SEGS = 1;
 constexpr const uint WOTLEN = (8 + 3 * WOTLEN_FEATURES + 8 * WOTLEN_MEM_SEGS);
@@ -306,109 +521,169 @@ uchar whatAreYou[] = {
     (memSize >> 16) & 0xFF,
     (memSize >> 24) & 0xFF};  //  length (W)
 
-BreakElement breakpoints[NO_OF_BREAKPOINTS];
-BreakElement watchpoints[NO_OF_WATCHPOINTS];
+/**
+ * @brief A machine's state at some moment, to be returned to later. Memory
+ * is copied on write: a page is only kept here once it is about to change.
+ */
+struct Snapshot {
+  std::vector<uchar> pages[snapshotPages];  // Contents when taken, if saved
+
+  BreakElement breakpoints[NO_OF_BREAKPOINTS];
+  BreakElement watchpoints[NO_OF_WATCHPOINTS];
+  uint emulBPFlag[2][NO_OF_BREAKPOINTS / 32];
+  uint emulWPFlag[2];
+
+  uchar status, oldStatus;
+  int stepsToGo;
+  uint stepsReset;
+
+  int r[16];
+  int usrR[7];
+  int fiqR[7];
+  int irqR[2];
+  int supR[2];
+  int abtR[2];
+  int underR[2];
+  uint cpsr;
+  uint spsr[32];
+
+  bool flagNZPending;
+  int flagCV;
+  uint flagResult, flagA, flagB;
+  int flagCarry;
+
+  int runUntilPC, runUntilSP, runUntilMode;
+  uchar runUntilStatus;
+  int nextFileHandle;
+  uint lastAddr;
+  uint pastOpcAddr[pastSize];
+  int pastCount;
+  int BLPrefix;
+
+  ringBuffer terminal0Tx, terminal0Rx;
+  ringBuffer terminal1Tx, terminal1Rx;
+};
+
+/**
+ * @brief Everything belonging to one emulated board. Any number may exist;
+ * the emulator works on whichever "machine" points to, which is per thread so
+ * that separate machines can run concurrently.
+ */
+struct Machine {
+  BreakElement breakpoints[NO_OF_BREAKPOINTS];
+  BreakElement watchpoints[NO_OF_WATCHPOINTS];
+
+  uint emulBPFlag[2][NO_OF_BREAKPOINTS / 32];  // Defined, enabled; 32 per word
+  uint emulWPFlag[2];
 
-uint emulBPFlag[2];
-uint emulWPFlag[2];
+  // Active breakpoints, indexed for the per-instruction check
+  std::unordered_map<uint, std::vector<uchar>> exactBreakpoints;  // By address
+  std::vector<uchar> rangeBreakpoints;  // Anything not a single address
+  uint breakpointFilter[0X80];          // Hashed addresses of exactBreakpoints
 
-uchar memory[RAMSIZE];
+  uint watchedPages[memSize >> watchPageShift];  // Watchpoints that may match
+  uint activeWatchpoints;                        // Those anywhere at all
 
-uchar status, oldStatus;
-int stepsToGo;    // Number of left steps before halting (0 is infinite)
-uint stepsReset;  // Number of steps since last reset
-char runFlags;
-uchar rtf;
-bool breakpointEnable;   // Breakpoints will be checked
-bool breakpointEnabled;  // Breakpoints will be checked now
-bool runThroughBL;       // Treat BL as a single step
-bool runThroughSWI;      // Treat SWI as a single step
+  uchar memory[RAMSIZE];
 
-uint tubeAddress;
+  decodedInstruction decodeCache[decodeCacheSize];
+  decodedInstruction uncached;  // For fetches from outside memory
 
-int r[16];
-int fiqR[7];
-int irqR[2];
-int supR[2];
-int abtR[2];
-int underR[2];
-uint cpsr;
-uint spsr[32];  // Lots of wasted space - safe for any "mode"
+  basicBlock blockCache[blockCacheSize];
+  uint blockGeneration = 1;  // Blocks from older generations are stale
+  bool codePage[memSize >> codePageShift];  // Holds some translated block
 
-bool printOut;
-int runUntilPC, runUntilSP, runUntilMode;  // Used to determine when
-uchar runUntilStatus;  //  to finish a `stepped' subroutine, SWI, etc.
+  uchar status, oldStatus;
+  int stepsToGo;    // Number of left steps before halting (0 is infinite)
+  uint stepsReset;  // Number of steps since last reset
+  char runFlags;
+  uchar rtf;
+  bool breakpointEnable;   // Breakpoints will be checked
+  bool breakpointEnabled;  // Breakpoints will be checked now
+  bool runThroughBL;       // Treat BL as a single step
+  bool runThroughSWI;      // Treat SWI as a single step
+  bool batchMode;          // Terminal is batchIn/batchOut; no monitor
+  bool batchInputEnded;    // SWI 1 found the end of batchIn
+  FILE* batchIn;
+  FILE* batchOut;
 
-uint exceptionPara[9];
+  uint tubeAddress;
 
-int nextFileHandle;
-FILE*(fileHandle[20]);
+  int r[16];    // Registers as seen by the current mode
+  int usrR[7];  // R8-R14 of user mode, when banked out
+  int fiqR[7];
+  int irqR[2];
+  int supR[2];
+  int abtR[2];
+  int underR[2];
+  uint cpsr;
+  uint spsr[32];  // Lots of wasted space - safe for any "mode"
 
-int count;
+  // Flags are evaluated lazily: cpsr NZCV are stale while these are pending
+  bool flagNZPending;  // N and Z from flagResult
+  int flagCV;          // C and V from the operation on flagA/flagB
+  uint flagResult, flagA, flagB;
+  int flagCarry;
 
-uint lastAddr;
+  bool printOut;
+  int runUntilPC, runUntilSP, runUntilMode;  // Used to determine when
+  uchar runUntilStatus;  //  to finish a `stepped' subroutine, SWI, etc.
 
-int glob1, glob2;
+  int nextFileHandle;
 
-int pastOpcAddr[32];  // History buffer of fetched op. code addresses
-int pastSize;         // Used size of buffer
-int pastOpcPtr;       // Pointer into same
-int pastCount;        // Count of hits in instruction history
+  uint lastAddr;
 
-// Thumb stuff
-int PC;
-int BLPrefix, BLAddress;
-int ARMFlag;
+  int glob1, glob2;
 
-struct pollfd* SWIPoll;  // Pointer to allow SWI to scan input - YUK!
+  uint pastOpcAddr[pastSize];  // Fetched op. code addresses, direct mapped
+  bool pastEnabled;            // Keep the history (it costs every fetch)
+  int pastCount;               // Count of hits in instruction history
+
+  // Thumb stuff
+  int BLPrefix;
+
+  uint quantum;           // Instructions run before the monitor is checked
+  bool yieldQuantum;      // Something the monitor may want to see happened
+  uint perfInstructions;  // Instructions executed since the last start ...
+  long perfNanoseconds;   // ... and the time spent running them
+
+  std::unique_ptr<uint[]> profile;  // Executions per half-word, if profiling
+
+  traceHeader* trace;  // Mapped trace file, if tracing
+  traceRecord* traceRing;
+
+  ringBuffer terminal0Tx, terminal0Rx;
+  ringBuffer terminal1Tx, terminal1Rx;
+  ringBuffer* terminalTable[16][2];
 
-ringBuffer terminal0Tx, terminal0Rx;
-ringBuffer terminal1Tx, terminal1Rx;
-ringBuffer* terminalTable[16][2];
+  std::unique_ptr<Snapshot> snapshot;  // Taken by BR_SNAPSHOT, if any
+  uint cleanPages[snapshotPages / 32];  // Unwritten since snapshot or restore
+};
+
+thread_local Machine* machine;  // The one being emulated
+
+struct pollfd* SWIPoll;  // Pointer to allow SWI to scan input - YUK!
 
 /**
  * @brief Program entry point.
  * @return int Exit code.
  */
 int main(int argc, char** argv) {
-  for (int i = 0; i < 16; i++) {
-    terminalTable[i][0] = NULL;
-    terminalTable[i][1] = NULL;
+  if (argc > 1) {
+    return batchMain(argc, argv);
   }
 
-  initBuffer(&terminal0Tx);  // Initialise terminal
-  initBuffer(&terminal0Rx);
-  terminalTable[0][0] = &terminal0Tx;
-  terminalTable[0][1] = &terminal0Rx;
-  initBuffer(&terminal1Tx);  // Initialise terminal
-  initBuffer(&terminal1Rx);
-  terminalTable[1][0] = &terminal1Tx;
-  terminalTable[1][1] = &terminal1Rx;
+  newMachine();
 
   pollfd.fd = 0;
   pollfd.events = POLLIN;
   SWIPoll = &pollfd;  // Grubby pass to "mySystem"
 
-  emulSetup();
-
-  emulBPFlag[0] = 0;
-  if (NO_OF_BREAKPOINTS == 0) {
-    emulBPFlag[1] = 0x00000000;  // C work around
-  } else {
-    emulBPFlag[1] = (1 << NO_OF_WATCHPOINTS) - 1;
-  }
-
-  emulWPFlag[0] = 0;
-  if (NO_OF_WATCHPOINTS == 0) {
-    emulWPFlag[1] = 0x00000000;  // C work around
-  } else {
-    emulWPFlag[1] = (1 << NO_OF_WATCHPOINTS) - 1;
-  }
-
   while (true) {
-    comm(&pollfd);  // Check for monitor command
-    if ((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_RUNNING) {
-      step();  // Step emulator as required
+    comm(&pollfd, 0);  // Check for monitor command
+    if ((machine->status & CLIENT_STATE_CLASS_MASK) ==
+        CLIENT_STATE_CLASS_RUNNING) {
+      runQuantum();  // Step emulator as required
     } else {
       poll(&pollfd, 1, -1);  // If not running, deschedule until command arrives
     }
@@ -417,41 +692,130 @@ int main(int argc, char** argv) {
   return 0;
 }
 
+/**
+ * @brief Creates a machine in its reset state and makes it this thread's
+ * current one.
+ * @return Machine* To be deleted by the caller when finished with
+ */
+Machine* newMachine() {
+  machine = new Machine();
+
+  for (int i = 0; i < 16; i++) {
+    machine->terminalTable[i][0] = NULL;
+    machine->terminalTable[i][1] = NULL;
+  }
+
+  initBuffer(&machine->terminal0Tx);  // Initialise terminal
+  initBuffer(&machine->terminal0Rx);
+  machine->terminalTable[0][0] = &machine->terminal0Tx;
+  machine->terminalTable[0][1] = &machine->terminal0Rx;
+  initBuffer(&machine->terminal1Tx);  // Initialise terminal
+  initBuffer(&machine->terminal1Rx);
+  machine->terminalTable[1][0] = &machine->terminal1Tx;
+  machine->terminalTable[1][1] = &machine->terminal1Rx;
+
+  emulSetup();
+
+  machine->quantum = 1024;
+  for (int i = 0; i < NO_OF_BREAKPOINTS / 32; i++) {
+    machine->emulBPFlag[0][i] = 0;
+    machine->emulBPFlag[1][i] = 0XFFFFFFFF;  // All available
+  }
+  indexBreakpoints();
+
+  machine->emulWPFlag[0] = 0;
+  machine->emulWPFlag[1] = allWatchpoints;
+  indexWatchpoints();
+
+  return machine;
+}
+
 /**
  * @brief
  */
 void step() {
-  oldStatus = status;
+  machine->oldStatus = machine->status;
   executeInstruction();
 
   // Still running - i.e. no breakpoint (etc.) found
-  if ((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_RUNNING) {
+  if ((machine->status & CLIENT_STATE_CLASS_MASK) ==
+      CLIENT_STATE_CLASS_RUNNING) {
     // don't count the instructions from now
-    if (status == CLIENT_STATE_RUNNING_SWI) {
-      if ((getRegisterMonitor(15, regCurrent) == runUntilPC) &&
-          (getRegisterMonitor(13, regCurrent) == runUntilSP) &&
-          ((getRegisterMonitor(16, regCurrent) & 0x3F) == runUntilMode)) {
-        status = runUntilStatus;
+    if (machine->status == CLIENT_STATE_RUNNING_SWI) {
+      if ((getRegisterMonitor(15, regCurrent) == machine->runUntilPC) &&
+          (getRegisterMonitor(13, regCurrent) == machine->runUntilSP) &&
+          ((getRegisterMonitor(16, regCurrent) & 0x3F) ==
+           machine->runUntilMode)) {
+        machine->status = machine->runUntilStatus;
       }
     }  // This can have changed status - hence no "else" below`
 
     // OR _BL
-    if (status != CLIENT_STATE_RUNNING_SWI) {
+    if (machine->status != CLIENT_STATE_RUNNING_SWI) {
       // Count steps unless inside routine
-      stepsReset++;
+      machine->stepsReset++;
 
       // Stepping
-      if (stepsToGo > 0) {
-        stepsToGo--;  // If -decremented- to reach zero, stop
-        if (stepsToGo == 0) {
-          status = CLIENT_STATE_STOPPED;
+      if (machine->stepsToGo > 0) {
+        machine->stepsToGo--;  // If -decremented- to reach zero, stop
+        if (machine->stepsToGo == 0) {
+          machine->status = CLIENT_STATE_STOPPED;
         }
       }
     }
   }
 
-  if ((status & CLIENT_STATE_CLASS_MASK) != CLIENT_STATE_CLASS_RUNNING) {
-    breakpointEnabled = false;  // No longer running - allow "continue"
+  if ((machine->status & CLIENT_STATE_CLASS_MASK) !=
+      CLIENT_STATE_CLASS_RUNNING) {
+    machine->breakpointEnabled = false;  // No longer running - allow "continue"
+  }
+}
+
+/**
+ * @brief Advances the emulator; through the block engine when nothing needs
+ * to be watched on an instruction-by-instruction basis.
+ * @return uint The number of instructions executed.
+ */
+uint run() {
+  if (blockEngineUsable()) {
+    return runBlocks(blockChainLimit);
+  }
+
+  step();
+  return 1;
+}
+
+/**
+ * @brief Runs up to "quantum" instructions without looking at the monitor,
+ * stopping early if the emulator stops or executes a SWI. The quantum is
+ * adjusted so that each one takes about quantumTargetNs.
+ */
+void runQuantum() {
+  struct timespec start, end;
+  uint done = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  machine->yieldQuantum = false;
+
+  while ((done < machine->quantum) && !machine->yieldQuantum &&
+         ((machine->status & CLIENT_STATE_CLASS_MASK) ==
+          CLIENT_STATE_CLASS_RUNNING)) {
+    done += run();
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long elapsed = (end.tv_sec - start.tv_sec) * 1000000000L +
+                 (end.tv_nsec - start.tv_nsec);
+  machine->perfInstructions += done;
+  machine->perfNanoseconds += elapsed;
+
+  // Only a full quantum says anything about speed
+  if (done >= machine->quantum) {
+    if ((elapsed < quantumTargetNs / 2) && (machine->quantum < maxQuantum)) {
+      machine->quantum *= 2;
+    } else if ((elapsed > quantumTargetNs) && (machine->quantum > minQuantum)) {
+      machine->quantum /= 2;
+    }
   }
 }
 
@@ -478,83 +842,131 @@ void monitorOptionsMisc(uchar command) {
       boardreset();
       break;
 
+    case BR_SNAPSHOT:
+      takeSnapshot();
+      break;
+
+    case BR_RESTORE: /* Replies with the pages copied back; -1 if no snapshot */
+      sendNBytes(restoreSnapshot(), 4);
+      break;
+
     case BR_RTF_GET:
-      sendChar(rtf);
+      sendChar(machine->rtf);
       break;
 
     case BR_RTF_SET:
-      getChar(&rtf);
+      getChar(&machine->rtf);
       break;
 
     case BR_WOT_U_DO:
-      sendChar(status);
-      sendNBytes(stepsToGo, 4);
-      sendNBytes(stepsReset, 4);
+      sendChar(machine->status);
+      sendNBytes(machine->stepsToGo, 4);
+      sendNBytes(machine->stepsReset, 4);
+      break;
+
+    case BR_PROFILE_SET: /* Non-zero starts counting afresh; zero stops */
+      getChar(&tempchar);
+      setProfiling(tempchar != 0);
+      break;
+
+    case BR_PROFILE_GET: { /* Count, then address/count of the hottest N */
+      getNBytes(&temp, 2);
+      const std::vector<std::pair<uint, uint>> spots = hotSpots(temp);
+
+      sendNBytes(spots.size(), 4);
+      for (const std::pair<uint, uint>& spot : spots) {
+        sendNBytes(spot.first, 4);
+        sendNBytes(spot.second, 4);
+      }
+    } break;
+
+    case BR_PERF_GET: /* Instructions/second since the last start */
+      if (machine->perfNanoseconds > 0) {
+        temp = (machine->perfInstructions * 1000000000.0) /
+               machine->perfNanoseconds;
+      } else {
+        temp = 0;
+      }
+      sendNBytes(temp, 4);
+      sendNBytes(machine->quantum, 4);
       break;
 
     case BR_PAUSE:
     case BR_STOP:
-      if ((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_RUNNING) {
-        oldStatus = status;
-        status = CLIENT_STATE_STOPPED;
+      if ((machine->status & CLIENT_STATE_CLASS_MASK) ==
+          CLIENT_STATE_CLASS_RUNNING) {
+        machine->oldStatus = machine->status;
+        machine->status = CLIENT_STATE_STOPPED;
       }
       break;
 
     case BR_CONTINUE:
-      if (((status & CLIENT_STATE_CLASS_MASK) == CLIENT_STATE_CLASS_STOPPED) &&
-          (status != CLIENT_STATE_BYPROG))  // Only act if already stopped
-        if ((oldStatus = CLIENT_STATE_STEPPING) || (stepsToGo != 0))
-          status = oldStatus;
+      // Only act if already stopped
+      if (((machine->status & CLIENT_STATE_CLASS_MASK) ==
+           CLIENT_STATE_CLASS_STOPPED) &&
+          (machine->status != CLIENT_STATE_BYPROG))
+        if ((machine->oldStatus = CLIENT_STATE_STEPPING) ||
+            (machine->stepsToGo != 0))
+          machine->status = machine->oldStatus;
       break;
 
     case BR_BP_GET:
-      sendNBytes(emulBPFlag[0], 4);
-      sendNBytes(emulBPFlag[1], 4);
+      sendNBytes(machine->emulBPFlag[0][0], 4);
+      sendNBytes(machine->emulBPFlag[1][0], 4);
       break;
 
-    case BR_BP_SET: {
-      int data[2];
-      getNBytes(&data[0], 4);
-      getNBytes(&data[1], 4);
-      /* Note ordering to avoid temporary variable */
-      emulBPFlag[1] = (~emulBPFlag[0] & emulBPFlag[1]) |
-                      (emulBPFlag[0] & ((emulBPFlag[1] & ~data[0]) | data[1]));
-      emulBPFlag[0] = emulBPFlag[0] & (data[0] | ~data[1]);
-    } break;
+    case BR_BP_SET:
+      setBreakpointFlags(0);
+      break;
+
+    case BR_BP_GET_EXT: /* As BR_BP_GET, for breakpoints 32n to 32n+31 */
+      getChar(&tempchar);
+      temp = tempchar % (NO_OF_BREAKPOINTS / 32);
+      sendNBytes(machine->emulBPFlag[0][temp], 4);
+      sendNBytes(machine->emulBPFlag[1][temp], 4);
+      break;
+
+    case BR_BP_SET_EXT:
+      getChar(&tempchar);
+      setBreakpointFlags(tempchar % (NO_OF_BREAKPOINTS / 32));
+      break;
 
     case BR_BP_READ:
       getChar(&tempchar);
       temp = tempchar;
-      sendChar(breakpoints[temp].cond);
-      sendChar(breakpoints[temp].size);
-      sendNBytes(breakpoints[temp].addrA, 4);
-      sendNBytes(breakpoints[temp].addrB, 4);
-      sendNBytes(breakpoints[temp].dataA[0], 4);
-      sendNBytes(breakpoints[temp].dataA[1], 4);
-      sendNBytes(breakpoints[temp].dataB[0], 4);
-      sendNBytes(breakpoints[temp].dataB[1], 4);
+      sendChar(machine->breakpoints[temp].cond);
+      sendChar(machine->breakpoints[temp].size);
+      sendNBytes(machine->breakpoints[temp].addrA, 4);
+      sendNBytes(machine->breakpoints[temp].addrB, 4);
+      sendNBytes(machine->breakpoints[temp].dataA[0], 4);
+      sendNBytes(machine->breakpoints[temp].dataA[1], 4);
+      sendNBytes(machine->breakpoints[temp].dataB[0], 4);
+      sendNBytes(machine->breakpoints[temp].dataB[1], 4);
       break;
 
     case BR_BP_WRITE:
       getChar(&tempchar);
       temp = tempchar;
-      getChar(&breakpoints[temp].cond);
-      getChar(&breakpoints[temp].size);
-      getNBytes(&breakpoints[temp].addrA, 4);
-      getNBytes(&breakpoints[temp].addrB, 4);
-      getNBytes(&breakpoints[temp].dataA[0], 4);
-      getNBytes(&breakpoints[temp].dataA[1], 4);
-      getNBytes(&breakpoints[temp].dataB[0], 4);
-      getNBytes(&breakpoints[temp].dataB[1], 4);
+      getChar(&machine->breakpoints[temp].cond);
+      getChar(&machine->breakpoints[temp].size);
+      getNBytes(&machine->breakpoints[temp].addrA, 4);
+      getNBytes(&machine->breakpoints[temp].addrB, 4);
+      getNBytes(&machine->breakpoints[temp].dataA[0], 4);
+      getNBytes(&machine->breakpoints[temp].dataA[1], 4);
+      getNBytes(&machine->breakpoints[temp].dataB[0], 4);
+      getNBytes(&machine->breakpoints[temp].dataB[1], 4);
       /* add breakpoint */
-      temp = (1 << temp) & ~emulBPFlag[0];
-      emulBPFlag[0] |= temp;
-      emulBPFlag[1] |= temp;
+      {
+        uint bit = (1 << (temp & 31)) & ~machine->emulBPFlag[0][temp >> 5];
+        machine->emulBPFlag[0][temp >> 5] |= bit;
+        machine->emulBPFlag[1][temp >> 5] |= bit;
+      }
+      indexBreakpoints();
       break;
 
     case BR_WP_GET:
-      sendNBytes(emulWPFlag[0], 4);
-      sendNBytes(emulWPFlag[1], 4);
+      sendNBytes(machine->emulWPFlag[0], 4);
+      sendNBytes(machine->emulWPFlag[1], 4);
       break;
 
     case BR_WP_SET: {
@@ -562,77 +974,106 @@ void monitorOptionsMisc(uchar command) {
       getNBytes(&data[0], 4);
       getNBytes(&data[1], 4);
       temp = data[1] & ~data[0];
-      emulWPFlag[0] &= ~temp;
-      emulWPFlag[1] |= temp;
-      temp = data[0] & emulWPFlag[0];
-      emulWPFlag[1] = (emulWPFlag[1] & ~temp) | (data[1] & temp);
+      machine->emulWPFlag[0] &= ~temp;
+      machine->emulWPFlag[1] |= temp;
+      temp = data[0] & machine->emulWPFlag[0];
+      machine->emulWPFlag[1] =
+          (machine->emulWPFlag[1] & ~temp) | (data[1] & temp);
+      indexWatchpoints();
     } break;
 
-    case BR_WP_READ:
+    case BR_WP_READ: {
+      BreakElement none = {}; /* Reported for a watchpoint that isn't */
+      const BreakElement* wp = &none;
+
       getChar(&tempchar);
       temp = tempchar;
-      sendChar(watchpoints[temp].cond);
-      sendChar(watchpoints[temp].size);
-      sendNBytes(watchpoints[temp].addrA, 4);
-      sendNBytes(watchpoints[temp].addrB, 4);
-      sendNBytes(watchpoints[temp].dataA[0], 4);
-      sendNBytes(watchpoints[temp].dataA[1], 4);
-      sendNBytes(watchpoints[temp].dataB[0], 4);
-      sendNBytes(watchpoints[temp].dataB[1], 4);
-      break;
+      if (temp < NO_OF_WATCHPOINTS) {
+        wp = &machine->watchpoints[temp];
+      }
+      sendChar(wp->cond);
+      sendChar(wp->size);
+      sendNBytes(wp->addrA, 4);
+      sendNBytes(wp->addrB, 4);
+      sendNBytes(wp->dataA[0], 4);
+      sendNBytes(wp->dataA[1], 4);
+      sendNBytes(wp->dataB[0], 4);
+      sendNBytes(wp->dataB[1], 4);
+    } break;
+
+    case BR_WP_WRITE: {
+      BreakElement ignored; /* Read, so the protocol stays in step */
+      BreakElement* wp = &ignored;
 
-    case BR_WP_WRITE:
       getChar(&tempchar);
       temp = tempchar;
-      getChar(&watchpoints[temp].cond);
-      getChar(&watchpoints[temp].size);
-      getNBytes(&watchpoints[temp].addrA, 4);
-      getNBytes(&watchpoints[temp].addrB, 4);
-      getNBytes(&watchpoints[temp].dataA[0], 4);
-      getNBytes(&watchpoints[temp].dataA[1], 4);
-      getNBytes(&watchpoints[temp].dataB[0], 4);
-      getNBytes(&watchpoints[temp].dataB[1], 4);
-      temp = 1 << temp & ~emulWPFlag[0];
-      emulWPFlag[0] |= temp;
-      emulWPFlag[1] |= temp;
-      break;
+      if (temp < NO_OF_WATCHPOINTS) {
+        wp = &machine->watchpoints[temp];
+      }
+      getChar(&wp->cond);
+      getChar(&wp->size);
+      getNBytes(&wp->addrA, 4);
+      getNBytes(&wp->addrB, 4);
+      getNBytes(&wp->dataA[0], 4);
+      getNBytes(&wp->dataA[1], 4);
+      getNBytes(&wp->dataB[0], 4);
+      getNBytes(&wp->dataB[1], 4);
+      if (temp < NO_OF_WATCHPOINTS) { /* No such watchpoint otherwise */
+        temp = (1U << temp) & ~machine->emulWPFlag[0];
+        machine->emulWPFlag[0] |= temp;
+        machine->emulWPFlag[1] |= temp;
+        indexWatchpoints();
+      }
+    } break;
 
     case BR_FR_WRITE: {
       uchar device, length;
+      uchar text[0X100];
       ringBuffer* pBuff;
 
       getChar(&device);
-      pBuff = terminalTable[device][1];
+      pBuff = machine->terminalTable[device & 0XF][1];
       getChar(&length);
-      temp = tempchar;
-      while (length-- > 0) {
-        getChar(&tempchar); /* Read character */
-        if (pBuff != NULL)
-          putBuffer(pBuff, tempchar); /*  and put in buffer */
+      getCharArray(length, text);
+      if (pBuff != NULL) {
+        putBufferBlock(pBuff, text, length); /* Any overflow is lost */
       }
       sendChar(0);
     } break;
 
     case BR_FR_READ: {
       uchar device, max_length;
-      uint i, length, available;
+      uchar text[0X100];
+      uint length = 0;
       ringBuffer* pBuff;
 
       getChar(&device);
-      pBuff = terminalTable[device][0];
+      pBuff = machine->terminalTable[device & 0XF][0];
       getChar(&max_length);
-      available = countBuffer(&terminal0Tx); /* See how many chars we have */
-      if (pBuff == NULL) {
-        length = 0; /* Kill if no corresponding buffer */
-      } else {
-        length = available < max_length ? available : max_length;
+      if (pBuff != NULL) { /* Kill if no corresponding buffer */
+        length = getBufferBlock(pBuff, text, max_length);
       }
       sendChar(length);
-      for (i = 0; i < length; i++) /* Send zero or more characters */
-      {
-        uchar c;
-        getBuffer(pBuff, &c);
-        sendChar(c);
+      sendCharArray(length, text); /* Send zero or more characters */
+    } break;
+
+    case BR_FR_READ_ALL: { /* Everything buffered, after a 4-byte length */
+      uchar device;
+      uchar text[0X1000];
+      uint length = 0;
+      ringBuffer* pBuff;
+
+      getChar(&device);
+      pBuff = machine->terminalTable[device & 0XF][0];
+      if (pBuff != NULL) {
+        length = countBuffer(pBuff);
+      }
+      sendNBytes(length, 4);
+      while (length > 0) {
+        const uint got =
+            getBufferBlock(pBuff, text, std::min(length, (uint)sizeof(text)));
+        sendCharArray(got, text);
+        length -= got;
       }
     } break;
 
@@ -641,15 +1082,46 @@ void monitorOptionsMisc(uchar command) {
   }
 }
 
+/**
+ * @brief Loads memory from a 4-byte extent count then, for each extent, a
+ * 4-byte address, a 4-byte length and that many bytes. Extents are written in
+ * order, wrapping round the end of memory as single writes do.
+ */
+void monitorMemoryImage() {
+  int extents;
+
+  getNBytes(&extents, 4);
+  while (extents-- > 0) {
+    uint addr, length; /* Unsigned, so any length is consumed in full */
+
+    getNBytes((int*)&addr, 4);
+    getNBytes((int*)&length, 4);
+    while (length > 0) { /* Any piece past the end of memory wraps round */
+      const uint offset = addr & (RAMSIZE - 1);
+      const uint piece = std::min(length, RAMSIZE - offset);
+
+      preservePages(offset, piece);
+      getCharArray(piece, machine->memory + offset);
+      invalidateDecodeCache(offset, piece);
+      addr += piece;
+      length -= piece;
+    }
+  }
+}
+
 /**
  * @brief
  * @param c
  */
 void monitorMemory(uchar c) {
   int addr;
-  uchar* pointer;
   int size;
 
+  if (c == BR_SET_MEM_IMAGE) {
+    monitorMemoryImage();
+    return;
+  }
+
   getNBytes(&addr, 4);  // Start address really
   if ((c & 0x30) == 0x10) {
     int temp;
@@ -693,15 +1165,23 @@ void monitorMemory(uchar c) {
         putRegister(reg_number++, temp, reg_bank);
       }
   } else {
-    pointer = memory + (addr & (RAMSIZE - 1));
+    uint offset = addr & (RAMSIZE - 1);
+
     getNBytes(&size, 2);
     size *= 1 << (c & 7);
-    if (((uchar*)pointer + size) > ((uchar*)memory + RAMSIZE))
-      pointer -= RAMSIZE;
-    if (c & 8)
-      sendCharArray(size, pointer);
-    else
-      getCharArray(size, pointer);
+    while (size > 0) { /* Any piece past the end of memory wraps round */
+      const uint piece = std::min((uint)size, RAMSIZE - offset);
+
+      if (c & 8) {
+        sendCharArray(piece, machine->memory + offset);
+      } else {
+        preservePages(offset, piece);
+        getCharArray(piece, machine->memory + offset);
+        invalidateDecodeCache(offset, piece);
+      }
+      offset = (offset + piece) & (RAMSIZE - 1);
+      size -= piece;
+    }
   }
 }
 
@@ -710,29 +1190,39 @@ void monitorMemory(uchar c) {
  * @param c
  */
 void monitorBreakpoints(uchar c) {
-  runFlags = c & 0x3F;
-  breakpointEnable = (runFlags & 0x10) != 0;
-  breakpointEnabled = (runFlags & 0x01) != 0; /* Break straight away */
-  runThroughBL = (runFlags & 0x02) != 0;
-  runThroughSWI = (runFlags & 0x04) != 0;
-  getNBytes(&stepsToGo, 4);
-  if (stepsToGo == 0)
-    status = CLIENT_STATE_RUNNING;
+  machine->runFlags = c & 0x3F;
+  machine->breakpointEnable = (machine->runFlags & 0x10) != 0;
+  /* Break straight away */
+  machine->breakpointEnabled = (machine->runFlags & 0x01) != 0;
+  machine->runThroughBL = (machine->runFlags & 0x02) != 0;
+  machine->runThroughSWI = (machine->runFlags & 0x04) != 0;
+  getNBytes(&machine->stepsToGo, 4);
+  if (machine->stepsToGo == 0)
+    machine->status = CLIENT_STATE_RUNNING;
   else
-    status = CLIENT_STATE_STEPPING;
+    machine->status = CLIENT_STATE_STEPPING;
+
+  machine->perfInstructions = 0;
+  machine->perfNanoseconds = 0;
 }
 
 /**
- * @brief
+ * @brief Carries out a monitor command, if one arrives in time.
  * @param pPollfd
+ * @param timeout Milliseconds to wait; -1 sleeps until a command arrives
  */
-void comm(struct pollfd* pPollfd) {
+void comm(struct pollfd* pPollfd, int timeout) {
   uchar c;
 
-  if (poll(pPollfd, 1, 0) > 0) {
-    if (read(0, &c, 1) < 0) {
+  if (poll(pPollfd, 1, timeout) > 0) {
+    const ssize_t got = read(0, &c, 1);
+
+    if (got == 0) {
+      exit(0);  // The monitor has gone; nothing can command us again
+    } else if (got < 0) {
       std::cout << "Some error occurred!" << std::endl;
-    }  // Look at error return - find EOF & exit
+      return;
+    }
     switch (c & 0xC0) {
       case 0x00:
         monitorOptionsMisc(c);
@@ -807,7 +1297,7 @@ int getNBytes(int* valPtr, int N) {
   *valPtr = 0;
 
   for (i = 0; i < No_received; i++) {
-    *valPtr = *valPtr | ((buffer[i] & 0xFF) << (i * 8)); /* Assemble integer */
+    *valPtr = *valPtr | ((uint)buffer[i] << (i * 8)); /* Assemble integer */
   }
 
   return No_received;
@@ -863,226 +1353,1645 @@ int sendCharArray(int charNumber, uchar* dataPtr) {
  * @brief
  */
 void emulSetup() {
-  glob1 = 0;
-  glob2 = 0;
+  machine->glob1 = 0;
+  machine->glob2 = 0;
 
-  for (int i = 0; i < 32; i++) {
-    pastOpcAddr[i] = 1;  // Illegal op. code address
+  for (uint i = 0; i < pastSize; i++) {
+    machine->pastOpcAddr[i] = 1;  // Illegal op. code address
   }
-  pastOpcPtr = 0;
-  pastCount = 0;
-  pastSize = 4;
+  machine->pastEnabled = true;
+  machine->pastCount = 0;
 
   int initialMode = 0xC0 | supMode;
-  printOut = false;
+  machine->printOut = false;
 
-  nextFileHandle = 1;
+  machine->nextFileHandle = 1;
 
   initialise(0, initialMode);
 }
 
 /**
- * @brief
- * @param instrAddr
- * @param instr
- * @return true
- * @return false
+ * @brief How every program of a batch is to be run.
  */
-bool checkBreakpoint(uint instrAddr, uint instr) {
-  bool mayBreak = false;
+struct batchOptions {
+  long limit;         // Instructions; 0 for none
+  uint hot;           // Hot spots to list after each run
+  const char* trace;  // File to trace into, if any
+  uint traceRecords;  // Size of the trace ring
+};
 
-  for (int i = 0; (i < NO_OF_BREAKPOINTS) && !mayBreak; i++) {
-    mayBreak = ((emulBPFlag[0] & emulBPFlag[1] & (1 << i)) !=
-                0);  // Breakpoint is active
+/**
+ * @brief One run of a batch: a program with one input.
+ */
+struct batchJob {
+  const char* path;
+  const char* input;  // NULL for "file.in", if present
+  std::string trace;  // File to trace into; empty for none
+  char* output;       // Terminal output, when not going straight to stdout
+  size_t outputLength;
+  int result;
+  std::string report;
+  std::string profile;  // Hot spots, if asked for
+};
 
-    // Try address comparison
-    if (mayBreak) {
-      switch (breakpoints[i].cond & 0x0C) {
-        case 0x00:
-        case 0x04:
-          mayBreak = false;
-          break;
-        // Case of between address A and address B
-        case 0x08:
-          if ((instrAddr < breakpoints[i].addrA) ||
-              (instrAddr > breakpoints[i].addrB)) {
-            mayBreak = false;
-          }
-          break;
-        // case of mask
-        case 0x0C:
-          if ((instrAddr & breakpoints[i].addrB) != breakpoints[i].addrA) {
-            mayBreak = false;
-          }
-          break;
-      }
+/**
+ * @brief Batch mode: runs .kmd files (or ELF executables) without the
+ * monitor until they halt (SWI 2) or reach an instruction limit (0 means
+ * none).
+ * Usage: jimulator [-l limit] [-j jobs] [-p hot] [-t trace [-T records]]
+ *                  [-i input]... file.kmd...
+ * A single program has terminal 0 on stdin/stdout. Otherwise programs are run
+ * on a pool of threads, one machine each, taking input from "file.in" if
+ * present or else once for each -i file (restarting from a snapshot taken
+ * after loading); the output is printed afterwards in order. -p lists the
+ * most executed instructions of each run. -t records each run's last
+ * instructions in a trace file, numbered "trace.N" if there are several.
+ * @param argc
+ * @param argv
+ * @return int The worst of the batchXXX exit statuses
+ */
+int batchMain(int argc, char** argv) {
+  batchOptions options = {maxInstructions, 0, NULL, traceRecords};
+  int jobs = std::thread::hardware_concurrency();
+  std::vector<const char*> inputs;
+  int option;
+
+  while ((option = getopt(argc, argv, "l:j:i:p:t:T:")) != -1) {
+    switch (option) {
+      case 'l':
+        options.limit = strtol(optarg, NULL, 0);
+        break;
+      case 'j':
+        jobs = strtol(optarg, NULL, 0);
+        break;
+      case 'i':
+        inputs.push_back(optarg);
+        break;
+      case 'p':
+        options.hot = strtoul(optarg, NULL, 0);
+        break;
+      case 't':
+        options.trace = optarg;
+        break;
+      case 'T':
+        options.traceRecords = strtoul(optarg, NULL, 0);
+        break;
+      default:
+        jobs = -1;
+        break;
     }
+  }
 
-    // Try data comparison
-    if (mayBreak) {
-      switch (breakpoints[i].cond & 0x03) {
-        case 0x00:
-          mayBreak = false;
-          break;
-
-        case 0x01:
-          mayBreak = false;
-          break;
+  const int count = argc - optind;
+  if ((count < 1) || (jobs < 0) || (options.limit < 0) ||
+      (options.limit > 0X7FFFFFFF) || (options.traceRecords == 0)) {
+    fprintf(stderr,
+            "usage: %s [-l instruction limit] [-j jobs] [-p hot spots] "
+            "[-t trace file [-T records]] [-i input]... file.kmd...\n",
+            argv[0]);
+    return batchError;
+  }
 
-        case 0x02:  // Case of between data A and data B
-          if ((instr < breakpoints[i].dataA[0]) ||
-              (instr > breakpoints[i].dataB[0])) {
-            mayBreak = false;
-          }
-          break;
+  const int runs = inputs.empty() ? 1 : inputs.size();
+  std::vector<batchJob> batch(count * runs);
 
-        case 0x03:  // Case of mask
-          if ((instr & breakpoints[i].dataB[0]) != breakpoints[i].dataA[0]) {
-            mayBreak = false;
-          }
-          break;
-      }
+  for (int i = 0; i < count * runs; i++) {
+    batch[i].path = argv[optind + i / runs];
+    batch[i].input = inputs.empty() ? NULL : inputs[i % runs];
+    if ((options.trace != NULL) && (count * runs == 1)) {
+      batch[i].trace = options.trace;
+    } else if (options.trace != NULL) {
+      batch[i].trace = std::string(options.trace) + "." + std::to_string(i);
     }
+    batch[i].output = NULL;
+    batch[i].outputLength = 0;
   }
-  return mayBreak;
-}
-
-/**
- * @brief
- */
-void executeInstruction() {
-  int i;
 
-  uint instr_addr =
-      getRegister(15, regCurrent) - instructionLength(cpsr, tfMask);
-  lastAddr = getRegister(15, regCurrent) - instructionLength(cpsr, tfMask);
+  if ((count == 1) && inputs.empty()) {
+    static char outputBuffer[0X10000];
+    batchJob* job = &batch[0];
 
-  /* FETCH */
-  auto instr = fetch();
+    setvbuf(stdout, outputBuffer, _IOFBF, sizeof(outputBuffer));
+    newMachine();
+    machine->batchIn = stdin;
+    machine->batchOut = stdout;
 
-  if ((breakpointEnabled) && (status != CLIENT_STATE_RUNNING_SWI)) {
-    if (checkBreakpoint(instr_addr, instr)) {
-      status = CLIENT_STATE_BREAKPOINT;
-      return;
+    if (loadProgram(job->path)) {
+      batchRun(job, &options);
+    } else {
+      job->result = batchError;
+      job->report = std::string("cannot read ") + job->path;
     }
+    fprintf(stderr, "%s: %s\n%s", argv[0], job->report.c_str(),
+            job->profile.c_str());
+    delete machine;
+    return job->result;
   }
-  breakpointEnabled = breakpointEnable; /* More likely after first fetch */
 
-  /* BL instruction */
-  if (((instr & 0x0F000000) == 0x0B000000) && runThroughBL) {
-    saveState(CLIENT_STATE_RUNNING_BL);
-  } else {
-    if (((instr & 0x0F000000) == 0x0F000000) && runThroughSWI) {
-      saveState(CLIENT_STATE_RUNNING_SWI);
+  std::vector<std::thread> pool;
+  std::atomic<int> next(0);
+
+  jobs = (jobs == 0) ? 1 : std::min(jobs, count);
+  for (int i = 0; i < jobs; i++) {
+    pool.emplace_back(batchWorker, batch.data(), count, runs, &next, &options);
+  }
+
+  int worst = batchHalted;
+  for (int i = 0; i < jobs; i++) {
+    pool[i].join();
+  }
+  for (batchJob& job : batch) {
+    if (job.input == NULL) {
+      printf("==> %s <==\n", job.path);
+      fprintf(stderr, "%s: %s: %s\n", argv[0], job.path, job.report.c_str());
+    } else {
+      printf("==> %s < %s <==\n", job.path, job.input);
+      fprintf(stderr, "%s: %s < %s: %s\n", argv[0], job.path, job.input,
+              job.report.c_str());
     }
+    fputs(job.profile.c_str(), stderr);
+    fwrite(job.output, 1, job.outputLength, stdout);
+    printf("\n");
+    free(job.output);
+    worst = std::max(worst, job.result);
   }
 
-  /* Execute */
-  execute(instr);
+  return worst;
 }
 
 /**
- * @brief Save state for leaving "procedure" {PC, SP, Mode, current state}
- * @param newStatus
+ * @brief Runs batch programs, each on a new machine, until none are left.
+ * A program is loaded once; later runs of it restore the snapshot taken
+ * straight after loading rather than reloading.
+ * @param batch Jobs, with the runs of each program together
+ * @param count Number of programs
+ * @param runs Number of runs of each program
+ * @param next Index of the next program to be taken
+ * @param options
  */
-void saveState(uchar newStatus) {
-  runUntilPC = getRegister(15, regCurrent);  // Incremented once: correct here
-  runUntilSP = getRegister(13, regCurrent);
-  runUntilMode = getRegister(16, regCurrent) & 0x3F;  // Just the mode bits
-  runUntilStatus = status;
-  status = newStatus;
-}
+void batchWorker(batchJob* batch, int count, int runs,
+                 std::atomic<int>* next, const batchOptions* options) {
+  for (int i = (*next)++; i < count; i = (*next)++) {
+    newMachine();
 
-/**
- * @brief
- */
-void boardreset() {
-  stepsReset = 0;
-  initialise(0, supMode);
+    for (int j = 0; j < runs; j++) {
+      batchJob* job = &batch[i * runs + j];
+      std::string input;
+
+      if (job->input != NULL) {
+        input = job->input;
+      } else {
+        input = job->path;
+        if ((input.size() > 4) &&
+            ((input.compare(input.size() - 4, 4, ".kmd") == 0) ||
+             (input.compare(input.size() - 4, 4, ".elf") == 0))) {
+          input.erase(input.size() - 4);
+        }
+        input += ".in";
+      }
+
+      if (j == 0) {
+        if (!loadProgram(job->path)) {
+          for (; j < runs; j++) {
+            job = &batch[i * runs + j];
+            job->result = batchError;
+            job->report = std::string("cannot read ") + job->path;
+          }
+          break;
+        }
+        takeSnapshot();
+      } else {
+        restoreSnapshot();
+      }
+
+      machine->batchIn = fopen(input.c_str(), "r");
+      if ((machine->batchIn == NULL) && (job->input != NULL)) {
+        job->result = batchError;  // Only "file.in" is optional
+        job->report = "cannot read " + input;
+        continue;
+      }
+      machine->batchOut = open_memstream(&job->output, &job->outputLength);
+
+      batchRun(job, options);
+
+      if (machine->batchIn != NULL) {
+        fclose(machine->batchIn);
+      }
+      fclose(machine->batchOut);
+    }
+
+    delete machine;
+  }
 }
 
 /**
- * @brief
- * @param startAddr
- * @param initMode
+ * @brief Runs the program loaded in the current machine, with terminal 0 on
+ * its batchIn/batchOut, profiling and tracing as asked.
+ * @param job Its result, report and profile are set
+ * @param options
  */
-void initialise(uint startAddr, int initMode) {
-  cpsr = 0X000000C0 | initMode;  // Disable interrupts
-  r[15] = startAddr;
-  oldStatus = CLIENT_STATE_RESET;
-  status = CLIENT_STATE_RESET;
+void batchRun(batchJob* job, const batchOptions* options) {
+  char text[0X100];
+
+  if (!job->trace.empty() &&
+      !startTrace(job->trace.c_str(), options->traceRecords)) {
+    job->result = batchError;
+    job->report = "cannot write " + job->trace;
+    return;
+  }
+  setProfiling(options->hot != 0);
+
+  machine->batchMode = true;
+  machine->pastEnabled = false;  // Nothing reports it
+  machine->batchInputEnded = false;
+  machine->runFlags = 0;
+  machine->breakpointEnable = false;
+  machine->breakpointEnabled = false;
+  machine->runThroughBL = false;
+  machine->runThroughSWI = false;
+  machine->stepsToGo = options->limit;
+  machine->status =
+      (options->limit == 0) ? CLIENT_STATE_RUNNING : CLIENT_STATE_STEPPING;
+
+  while ((machine->status & CLIENT_STATE_CLASS_MASK) ==
+         CLIENT_STATE_CLASS_RUNNING) {
+    run();
+  }
+  fflush(machine->batchOut);
+  stopTrace();
+
+  const char* reason;
+
+  if (machine->status == CLIENT_STATE_BYPROG) {
+    job->result = batchHalted;
+    reason = "halted";
+  } else if (machine->batchInputEnded) {
+    job->result = batchStopped;
+    reason = "stopped at end of input";
+  } else if ((machine->status == CLIENT_STATE_STOPPED) &&
+             (machine->stepsToGo == 0)) {
+    job->result = batchLimit;
+    reason = "instruction limit reached";
+  } else {
+    job->result = batchStopped;
+    reason = "stopped";
+  }
+
+  snprintf(text, sizeof(text), "%s after %u instructions, PC = %08X", reason,
+           machine->stepsReset, getRegisterMonitor(15, regCurrent));
+  job->report = text;
+  profileReport(job->path, options->hot, &job->profile);
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief Loads a program: an ELF executable if the file is one, else a .kmd
+ * file.
+ * @param path
+ * @return true if the file could be read (and, if ELF, loaded)
  */
-void execute(uint opCode) {
-  incPC(); /* Easier here than later */
+bool loadProgram(const char* path) {
+  const int fd = open(path, O_RDONLY);
+  struct stat status;
 
-  /* ARM or THUMB ? */
-  if ((cpsr & tfMask) != 0) /* Thumb */
-  {
-    opCode = opCode & 0XFFFF; /* 16-bit op. code */
-    switch (opCode & 0XE000) {
-      case 0X0000:
-        data0(opCode);
-        break;
-      case 0X2000:
-        data1(opCode);
-        break;
-      case 0X4000:
-        dataTransfer(opCode);
-        break;
-      case 0X6000:
-        transfer0(opCode);
-        break;
-      case 0X8000:
-        transfer1(opCode);
+  if (fd < 0) {
+    return false;
+  }
+  if ((fstat(fd, &status) != 0) || (status.st_size < SELFMAG)) {
+    close(fd);
+    return loadKMD(path);  // Too short to be ELF
+  }
+
+  void* mapped = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);  // The mapping keeps the file
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+
+  bool loaded;
+
+  if (memcmp(mapped, ELFMAG, SELFMAG) == 0) {
+    loaded = loadELF((const uchar*)mapped, status.st_size);
+  } else {
+    loaded = loadKMD(path);
+  }
+  munmap(mapped, status.st_size);
+  return loaded;
+}
+
+/**
+ * @brief Copies the loadable segments of a 32-bit little-endian ARM ELF
+ * executable (as produced by aasm -e) into memory, zeroing any part not in
+ * the file, and sets the PC to its entry point. Bytes beyond memory are
+ * dropped, as when loading a .kmd file.
+ * @param image The whole file
+ * @param length
+ * @return true if it is such an executable
+ */
+bool loadELF(const uchar* image, size_t length) {
+  const Elf32_Ehdr* header = (const Elf32_Ehdr*)image;
+
+  if ((length < sizeof(Elf32_Ehdr)) ||
+      (header->e_ident[EI_CLASS] != ELFCLASS32) ||
+      (header->e_ident[EI_DATA] != ELFDATA2LSB) ||
+      (header->e_machine != EM_ARM) ||
+      (header->e_phentsize != sizeof(Elf32_Phdr)) ||
+      (header->e_phoff > length) ||
+      ((length - header->e_phoff) / sizeof(Elf32_Phdr) < header->e_phnum)) {
+    return false;
+  }
+
+  const Elf32_Phdr* segments = (const Elf32_Phdr*)(image + header->e_phoff);
+
+  for (int i = 0; i < header->e_phnum; i++) { /* Check before loading any */
+    if ((segments[i].p_type == PT_LOAD) &&
+        ((segments[i].p_offset > length) ||
+         (segments[i].p_filesz > length - segments[i].p_offset) ||
+         (segments[i].p_filesz > segments[i].p_memsz))) {
+      return false;
+    }
+  }
+
+  for (int i = 0; i < header->e_phnum; i++) {
+    const Elf32_Phdr* segment = &segments[i];
+    const uint address = segment->p_paddr;
+
+    if ((segment->p_type != PT_LOAD) || (address >= memSize)) {
+      continue;
+    }
+
+    const uint size = std::min(segment->p_memsz, memSize - address);
+    const uint inFile = std::min(segment->p_filesz, size);
+
+    preservePages(address, size);
+    memcpy(&machine->memory[address], image + segment->p_offset, inFile);
+    memset(&machine->memory[address + inFile], 0, size - inFile);
+    invalidateDecodeCache(address, size);
+  }
+
+  putRegister(15, header->e_entry, regCurrent);
+  return true;
+}
+
+/**
+ * @brief Writes the memory image in a .kmd file (as produced by aasm) into
+ * memory. Symbol records and source text are ignored.
+ * @param pathToKMD
+ * @return true if the file could be read
+ */
+bool loadKMD(const char* pathToKMD) {
+  FILE* kmd = fopen(pathToKMD, "r");
+  char line[0X400];
+
+  if (kmd == NULL) {
+    return false;
+  }
+
+  while (fgets(line, sizeof(line), kmd) != NULL) {
+    char* ptr = line;
+    char* end;
+
+    if (*ptr == ':') {
+      continue;  // Symbol record
+    }
+
+    uint address = strtoul(ptr, &end, 16);
+    if ((end == ptr) || (*end != ':')) {
+      continue;  // No address, so no data
+    }
+    ptr = end + 1;
+
+    // Data fields up to the source text; the digit count gives the size
+    while (true) {
+      while ((*ptr == ' ') || (*ptr == '\t')) {
+        ptr++;
+      }
+
+      uint value = strtoul(ptr, &end, 16);
+      int digits = end - ptr;
+      if (digits == 0) {
         break;
-      case 0XA000:
-        spPC(opCode);
+      }
+
+      int size = 1;
+      while ((size < 4) && (size * 2 < digits)) {
+        size = size << 1;  // Round to 2^N bytes, clipping at a word
+      }
+
+      for (int i = 0; i < size; i++) {
+        writeMemory(address++, value >> (8 * i), 1, false, memSystem);
+      }
+      ptr = end;
+    }
+  }
+
+  fclose(kmd);
+  return true;
+}
+
+/**
+ * @brief Is there an active breakpoint at this instruction?
+ * @param instrAddr
+ * @param instr
+ * @return true
+ * @return false
+ */
+bool checkBreakpoint(uint instrAddr, uint instr) {
+  const uint hash = (instrAddr >> 1) & 0XFFF;
+
+  if ((machine->breakpointFilter[hash >> 5] & (1 << (hash & 31))) != 0) {
+    const auto found = machine->exactBreakpoints.find(instrAddr);
+
+    if (found != machine->exactBreakpoints.end()) {
+      for (const uchar i : found->second) {
+        if (breakpointMatches(i, instrAddr, instr)) {
+          return true;
+        }
+      }
+    }
+  }
+
+  for (const uchar i : machine->rangeBreakpoints) {
+    if (breakpointMatches(i, instrAddr, instr)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Compares an instruction against one breakpoint's conditions.
+ * @param i Breakpoint number
+ * @param instrAddr
+ * @param instr
+ * @return true
+ * @return false
+ */
+bool breakpointMatches(int i, uint instrAddr, uint instr) {
+  bool mayBreak = true;
+
+  // Try address comparison
+  switch (machine->breakpoints[i].cond & 0x0C) {
+    case 0x00:
+    case 0x04:
+      mayBreak = false;
+      break;
+    // Case of between address A and address B
+    case 0x08:
+      if ((instrAddr < (uint)machine->breakpoints[i].addrA) ||
+          (instrAddr > (uint)machine->breakpoints[i].addrB)) {
+        mayBreak = false;
+      }
+      break;
+    // case of mask
+    case 0x0C:
+      if ((instrAddr & machine->breakpoints[i].addrB) !=
+          (uint)machine->breakpoints[i].addrA) {
+        mayBreak = false;
+      }
+      break;
+  }
+
+  // Try data comparison
+  if (mayBreak) {
+    switch (machine->breakpoints[i].cond & 0x03) {
+      case 0x00:
+        mayBreak = false;
         break;
-      case 0XC000:
-        lsmB(opCode);
+
+      case 0x01:
+        mayBreak = false;
+        break;
+
+      case 0x02:  // Case of between data A and data B
+        if ((instr < (uint)machine->breakpoints[i].dataA[0]) ||
+            (instr > (uint)machine->breakpoints[i].dataB[0])) {
+          mayBreak = false;
+        }
         break;
-      case 0XE000:
-        thumbBranch(opCode);
+
+      case 0x03:  // Case of mask
+        if ((instr & machine->breakpoints[i].dataB[0]) !=
+            (uint)machine->breakpoints[i].dataA[0]) {
+          mayBreak = false;
+        }
+        break;
+    }
+  }
+  return mayBreak;
+}
+
+/**
+ * @brief Rebuilds the breakpoint index from the definitions and flags. Must
+ * be called whenever either changes.
+ */
+void indexBreakpoints() {
+  machine->exactBreakpoints.clear();
+  machine->rangeBreakpoints.clear();
+  for (uint& word : machine->breakpointFilter) {
+    word = 0;
+  }
+
+  for (int i = 0; i < NO_OF_BREAKPOINTS; i++) {
+    if ((machine->emulBPFlag[0][i >> 5] & machine->emulBPFlag[1][i >> 5] &
+         (1 << (i & 31))) == 0) {
+      continue;  // Breakpoint is not active
+    }
+
+    if (((machine->breakpoints[i].cond & 0x0C) == 0x0C) &&
+        (machine->breakpoints[i].addrB == (int)0XFFFFFFFF)) {  // Single address
+      const uint hash = (machine->breakpoints[i].addrA >> 1) & 0XFFF;
+
+      machine->exactBreakpoints[machine->breakpoints[i].addrA].push_back(i);
+      machine->breakpointFilter[hash >> 5] |= 1 << (hash & 31);
+    } else if ((machine->breakpoints[i].cond & 0x08) != 0) {  // Others can't
+      machine->rangeBreakpoints.push_back(i);
+    }
+  }
+
+  flushBlocks();  // Translations record where breakpoints match
+}
+
+/**
+ * @brief Implements BR_BP_SET: reads a mask of breakpoints to change and
+ * their new enable bits for one word of the flags.
+ * @param word Which 32 breakpoints
+ */
+void setBreakpointFlags(int word) {
+  int data[2];
+  uint* defined = &machine->emulBPFlag[0][word];
+  uint* enabled = &machine->emulBPFlag[1][word];
+
+  getNBytes(&data[0], 4);
+  getNBytes(&data[1], 4);
+  /* Note ordering to avoid temporary variable */
+  *enabled =
+      (~*defined & *enabled) | (*defined & ((*enabled & ~data[0]) | data[1]));
+  *defined = *defined & (data[0] | ~data[1]);
+  indexBreakpoints();
+}
+
+/**
+ * @brief
+ */
+void executeInstruction() {
+  uint instr_addr =
+      getRegister(15, regCurrent) - instructionLength(machine->cpsr, tfMask);
+  machine->lastAddr = instr_addr;
+
+  /* FETCH */
+  const decodedInstruction* decoded = fetch();
+  uint instr = decoded->opCode;
+
+  if ((machine->breakpointEnabled) &&
+      (machine->status != CLIENT_STATE_RUNNING_SWI)) {
+    if (checkBreakpoint(instr_addr, instr)) {
+      machine->status = CLIENT_STATE_BREAKPOINT;
+      return;
+    }
+  }
+  /* More likely after first fetch */
+  machine->breakpointEnabled = machine->breakpointEnable;
+
+  /* BL instruction */
+  if (((instr & 0x0F000000) == 0x0B000000) && machine->runThroughBL) {
+    saveState(CLIENT_STATE_RUNNING_BL);
+  } else {
+    if (((instr & 0x0F000000) == 0x0F000000) && machine->runThroughSWI) {
+      saveState(CLIENT_STATE_RUNNING_SWI);
+    }
+  }
+
+  /* Execute */
+  execute(decoded);
+}
+
+/**
+ * @brief Save state for leaving "procedure" {PC, SP, Mode, current state}
+ * @param newStatus
+ */
+void saveState(uchar newStatus) {
+  // Incremented once: correct here
+  machine->runUntilPC = getRegister(15, regCurrent);
+  machine->runUntilSP = getRegister(13, regCurrent);
+  machine->runUntilMode = getRegister(16, regCurrent) & 0x3F;  // Mode bits
+  machine->runUntilStatus = machine->status;
+  machine->status = newStatus;
+}
+
+/**
+ * @brief
+ */
+void boardreset() {
+  machine->stepsReset = 0;
+  initialise(0, supMode);
+}
+
+/**
+ * @brief
+ * @param startAddr
+ * @param initMode
+ */
+void initialise(uint startAddr, int initMode) {
+  setCPSR(0X000000C0 | initMode);  // Disable interrupts
+  machine->r[15] = startAddr;
+  machine->oldStatus = CLIENT_STATE_RESET;
+  machine->status = CLIENT_STATE_RESET;
+}
+
+/**
+ * @brief Executes a decoded instruction, subject to its condition.
+ * @param decoded
+ */
+void execute(const decodedInstruction* decoded) {
+  incPC(); /* Easier here than later */
+
+  if (machine->profile && (decoded->address < memSize)) {
+    machine->profile[decoded->address >> 1]++;
+  }
+
+  if (machine->trace != NULL) {
+    traceRecord* record = nextTraceRecord();  // Before any writes it makes
+
+    record->kind = traceInstruction;
+    record->size = instructionLength(machine->cpsr, tfMask);
+    record->address = decoded->address;
+    record->value = decoded->opCode;
+    if ((decoded->cond == 0XE) || checkCC(decoded->cond)) {
+      decoded->handler(decoded);
+    }
+    materialiseFlags();
+    record->cpsr = machine->cpsr;
+    return;
+  }
+
+  if ((decoded->cond == 0XE) || checkCC(decoded->cond)) {
+    decoded->handler(decoded);
+  }
+}
+
+/**
+ * @brief Adapts a handler which re-extracts its fields from the op. code.
+ * @param decoded
+ */
+template <void (*handler)(uint)>
+void opCodeHandler(const decodedInstruction* decoded) {
+  handler(decoded->opCode);
+}
+
+/**
+ * @brief Adapts a handler which takes no operands.
+ */
+template <void (*handler)()>
+void noOperandHandler(const decodedInstruction*) {
+  handler();
+}
+
+/**
+ * @brief BX/BLX (register), from its decoded fields.
+ * @param decoded
+ */
+void bxInstruction(const decodedInstruction* decoded) {
+  bx(decoded->rm, decoded->opCode & 0X00000020);
+}
+
+/**
+ * @brief Handler for ARM op. codes which can never execute (condition "NV").
+ */
+void neverExecuted(const decodedInstruction*) {}
+
+/**
+ * @brief Decodes an op. code for the instruction set currently selected.
+ * @param opCode
+ * @param decoded
+ */
+void decode(uint opCode, decodedInstruction* decoded) {
+  decoded->opCode = opCode;
+  decoded->cond = 0XE;
+  decoded->rd = (opCode & rdMask) >> 12;
+  decoded->rn = (opCode & rnMask) >> 16;
+  decoded->rm = opCode & rmMask;
+  decoded->operation = (opCode & dataOpMask) >> 21;
+  decoded->offset = 0;
+
+  if ((machine->cpsr & tfMask) != 0) {
+    decodeThumb(opCode, decoded);
+  } else {
+    decodeARM(opCode, decoded);
+  }
+}
+
+/**
+ * @brief A table of handlers, indexed by some bits of the op. code, built at
+ * compile time.
+ * @tparam size Entries
+ * @tparam handlerFor The handler for each index
+ */
+template <uint size, instructionHandler (*handlerFor)(uint)>
+struct decodeTable {
+  instructionHandler handler[size];
+
+  constexpr decodeTable() : handler() {
+    for (uint i = 0; i < size; i++) {
+      handler[i] = handlerFor(i);
+    }
+  }
+};
+
+/**
+ * @brief The data processing handlers, by op. code bits 25:20 (I, the ALU
+ * function and S) and 6:4 (the shift form of a register operand).
+ * @return constexpr std::array<instructionHandler, 0X200>
+ */
+template <uint... index>
+constexpr std::array<instructionHandler, 0X200> dataOpHandlers(
+    std::integer_sequence<uint, index...>) {
+  return {{normalDataOp<(index >> 4) & 0XF,
+                        ((index & 0X100) != 0) ? operandImmediate : index & 7,
+                        (index & 8) != 0>...}};
+}
+
+constexpr const std::array<instructionHandler, 0X200> dataOps =
+    dataOpHandlers(std::make_integer_sequence<uint, 0X200>());
+
+/**
+ * @brief The index of a data processing op. code in dataOps.
+ * @param opCode
+ * @return constexpr uint
+ */
+constexpr uint dataOpIndex(uint opCode) {
+  return ((opCode >> 17) & 0X1F8) | ((opCode >> 4) & 7);
+}
+
+/**
+ * @brief The handler for an ARM op. code, from bits 27:20 and 7:4.
+ * @param key (Bits 27:20 << 4) | bits 7:4
+ * @return constexpr instructionHandler NULL where the remaining bits decide;
+ * armExtensionHandler() sorts those out.
+ */
+constexpr instructionHandler armHandlerFor(uint key) {
+  const uint opCode = ((key & 0XFF0) << 16) | ((key & 0X00F) << 4);
+
+  switch ((opCode >> 25) & 0X00000007) {
+    case 0X0: /* includes load/store hw & sb */
+    case 0X1: /* data processing & MSR # */
+      if (((opCode & mulMask) == mulOp) ||
+          ((opCode & longMulMask) == longMulOp)) {
+        return opCodeHandler<myMulti>;
+      } else if (((opCode & 0X0E000090) == 0X00000090) &&
+                 ((opCode & 0X00000060) != 0X00000000) &&
+                 ((opCode & 0X00100040) != 0X00000040)) {
+        /* Load/store hw & sb; a register offset needs bits 11:8 clear */
+        return ((opCode & immHwMask) != 0) ? opCodeHandler<transferSBHW>
+                                           : NULL;
+      } else if (((opCode & swpMask & 0X0FF000F0) == swpOp) ||
+                 ((opCode & dataExtMask) == arithExt)) {
+        return NULL; /* SWP, and the extensions in the TST/.../CMN space */
+      }
+      return dataOps[dataOpIndex(opCode)]; /* All data processing */
+    case 0X2:
+    case 0X3:
+      return opCodeHandler<transfer>;
+    case 0X4:
+      return opCodeHandler<multiple>;
+    case 0X5:
+      return branch;
+    case 0X6:
+      return noOperandHandler<undefined>;
+    default:
+      return opCodeHandler<mySystem>;
+  }
+}
+
+constexpr const decodeTable<0X1000, armHandlerFor> armTable;
+
+/**
+ * @brief The handler for an op. code in the data processing space which its
+ * armTable entry does not determine.
+ * @param opCode
+ * @return instructionHandler
+ */
+instructionHandler armExtensionHandler(uint opCode) {
+  if (isItSBHW(opCode) == true) {
+    return opCodeHandler<transferSBHW>;
+  } else if ((opCode & swpMask) == swpOp) {
+    return opCodeHandler<swap>;
+  } else if ((opCode & dataExtMask) == arithExt) {
+    /* TST, TEQ, CMP, CMN - all lie in this range, but have S set */
+    if ((opCode & 0X0FBF0FFF) == 0X010F0000) {
+      return opCodeHandler<mrs>;
+    } else if (((opCode & 0X0DB6F000) == 0X0120F000) &&
+               ((opCode & 0X02000010) != 0X00000010)) {
+      return opCodeHandler<msr>;
+    } else if ((opCode & 0X0FFFFFD0) == 0X012FFF10) {
+      return bxInstruction; /* BX/BLX */
+    } else if ((opCode & 0XFFF000F0) == 0XE1200070) {
+      return noOperandHandler<breakpoint>;
+    } else if ((opCode & 0X0FFF0FF0) == 0X016F0F10) {
+      return opCodeHandler<clz>;
+    }
+    return noOperandHandler<undefined>;
+  }
+  return dataOps[dataOpIndex(opCode)];
+}
+
+/**
+ * @brief Resolves the handler for a 32-bit ARM op. code.
+ * @param opCode
+ * @param decoded
+ */
+void decodeARM(uint opCode, decodedInstruction* decoded) {
+  decoded->cond = opCode >> 28;
+
+  if ((opCode & 0XFE000000) == 0XFA000000) {
+    decoded->cond = 0XE; /* Nasty non-orthogonal BLX */
+  } else if (decoded->cond == 0XF) {
+    decoded->handler = neverExecuted;
+    return;
+  }
+
+  decoded->handler =
+      armTable.handler[((opCode >> 16) & 0XFF0) | ((opCode >> 4) & 0X00F)];
+
+  if (decoded->handler == NULL) {
+    decoded->handler = armExtensionHandler(opCode);
+  } else if (decoded->handler == branch) {
+    decoded->offset = (opCode & branchField) << 2;
+    if ((opCode & branchSign) != 0) {
+      decoded->offset |= (~(branchField << 2) & 0XFFFFFFFC);  // sign extend
+    }
+    if ((opCode & 0XF0000000) == 0XF0000000) {
+      decoded->offset |= ((opCode >> 23) & 2);  // Other BLX fix-up
+    }
+  }
+
+  if ((opCode & 0X0E000000) == 0X02000000) { /* Data processing immediate */
+    const uint value = opCode & 0X0FF;
+    const uint rotation = (opCode & 0XF00) >> 7;
+
+    if (rotation == 0) {
+      decoded->offset = value;
+      decoded->shiftCarry = carryUnchanged;
+    } else {
+      decoded->offset = (value >> rotation) | (value << (32 - rotation));
+      decoded->shiftCarry = (uint)decoded->offset >> 31;
+    }
+  }
+}
+
+/**
+ * @brief The handler for a Thumb op. code, from its top ten bits; these
+ * select every format and operation, leaving only register and immediate
+ * fields for the handler.
+ * @param index Op. code bits 15:6
+ * @return constexpr instructionHandler
+ */
+constexpr instructionHandler thumbHandlerFor(uint index) {
+  constexpr const instructionHandler shifts[3] = {thumbShiftImmediate<0>,
+                                                  thumbShiftImmediate<1>,
+                                                  thumbShiftImmediate<2>};
+  constexpr const instructionHandler addSubs[4] = {
+      thumbAddSub<false, false>, thumbAddSub<false, true>,
+      thumbAddSub<true, false>, thumbAddSub<true, true>};
+  constexpr const instructionHandler immediates[4] = {
+      thumbImmediate<0>, thumbImmediate<1>, thumbImmediate<2>,
+      thumbImmediate<3>};
+  constexpr const instructionHandler dataOps[16] = {
+      thumbDataOp<0X0>, thumbDataOp<0X1>, thumbDataOp<0X2>, thumbDataOp<0X3>,
+      thumbDataOp<0X4>, thumbDataOp<0X5>, thumbDataOp<0X6>, thumbDataOp<0X7>,
+      thumbDataOp<0X8>, thumbDataOp<0X9>, thumbDataOp<0XA>, thumbDataOp<0XB>,
+      thumbDataOp<0XC>, thumbDataOp<0XD>, thumbDataOp<0XE>, thumbDataOp<0XF>};
+  constexpr const instructionHandler highRegisters[4] = {
+      thumbHighRegister<0>, thumbHighRegister<1>, thumbHighRegister<2>,
+      thumbHighRegister<3>};
+  constexpr const instructionHandler registerTransfers[8] = {
+      thumbTransferRegister<0>, thumbTransferRegister<1>,
+      thumbTransferRegister<2>, thumbTransferRegister<3>,
+      thumbTransferRegister<4>, thumbTransferRegister<5>,
+      thumbTransferRegister<6>, thumbTransferRegister<7>};
+  constexpr const instructionHandler immediateTransfers[4] = {
+      thumbTransferImmediate<false, 4>, thumbTransferImmediate<true, 4>,
+      thumbTransferImmediate<false, 1>, thumbTransferImmediate<true, 1>};
+  const uint opCode = index << 6;
+  const bool bit11 = (opCode & 0X0800) != 0;
+
+  switch (opCode >> 13) {
+    case 0X0:
+      if ((opCode & 0X1800) != 0X1800) {
+        return shifts[(opCode >> 11) & 3];
+      }
+      return addSubs[(opCode >> 9) & 3];
+
+    case 0X1:
+      return immediates[(opCode >> 11) & 3];
+
+    case 0X2:
+      if ((opCode & 0X1000) != 0) {
+        return registerTransfers[(opCode >> 9) & 7];
+      } else if (bit11) {
+        return thumbLoadLiteral;
+      } else if ((opCode & 0X0400) != 0) {
+        return highRegisters[(opCode >> 8) & 3];
+      }
+      return dataOps[(opCode >> 6) & 0XF];
+
+    case 0X3:
+      return immediateTransfers[(opCode >> 11) & 3];
+
+    case 0X4:
+      if ((opCode & 0X1000) == 0) {
+        return bit11 ? thumbTransferImmediate<true, 2>
+                     : thumbTransferImmediate<false, 2>;
+      }
+      return bit11 ? thumbTransferSP<true> : thumbTransferSP<false>;
+
+    case 0X5:
+      if ((opCode & 0X1000) == 0) {
+        return bit11 ? thumbAddress<true> : thumbAddress<false>;
+      }
+      switch (opCode & 0X0F00) {
+        case 0X0000:
+          return ((opCode & 0X0080) != 0) ? thumbAdjustSP<true>
+                                          : thumbAdjustSP<false>;
+        case 0X0400:
+        case 0X0500:
+          return thumbPushPop<false>;
+        case 0X0C00:
+        case 0X0D00:
+          return thumbPushPop<true>;
+        case 0X0E00:
+          return noOperandHandler<breakpoint>;
+        default:
+          return noOperandHandler<undefined>;
+      }
+
+    case 0X6:
+      if ((opCode & 0X1000) == 0) {
+        return bit11 ? thumbMultiple<true> : thumbMultiple<false>;
+      }
+      return ((opCode & 0X0F00) == 0X0F00) ? thumbSWI : thumbBranch;
+
+    default:
+      switch (opCode & 0X1800) {
+        case 0X0000:
+          return thumbBranch;
+        case 0X0800:
+          return thumbBranchSuffix<true>;
+        case 0X1000:
+          return thumbBranchPrefix;
+        default:
+          return thumbBranchSuffix<false>;
+      }
+  }
+}
+
+constexpr const decodeTable<0X400, thumbHandlerFor> thumbTable;
+
+/**
+ * @brief Resolves the handler for a 16-bit Thumb op. code.
+ * @param opCode
+ * @param decoded
+ */
+void decodeThumb(uint opCode, decodedInstruction* decoded) {
+  opCode = opCode & 0XFFFF; /* 16-bit op. code */
+  decoded->opCode = opCode;
+  decoded->handler = thumbTable.handler[opCode >> 6];
+
+  if ((opCode & 0XF000) == 0XD000) { /* B (1), checked as ARM conditions */
+    if ((opCode & 0X0F00) != 0X0F00) {
+      decoded->cond = (opCode >> 8) & 0XF;
+    }
+    decoded->offset = (opCode & 0X00FF) << 1;
+    if ((opCode & 0X0080) != 0) {
+      decoded->offset |= 0XFFFFFE00; /* sign extend */
+    }
+  } else if ((opCode & 0XF800) == 0XE000) { /* B (2) */
+    decoded->offset = (opCode & 0X07FF) << 1;
+    if ((opCode & 0X0400) != 0) {
+      decoded->offset |= 0XFFFFF000; /* sign extend */
+    }
+  }
+}
+
+/**
+ * @brief Drops any predecoded instructions overlapping the given bytes.
+ * @param address
+ * @param length
+ */
+void invalidateDecodeCache(uint address, uint length) {
+  /* Every decode cache entry has been visited after this many bytes */
+  const uint cached = std::min(length, decodeCacheSize * 2);
+
+  if (length == 0) {
+    return;
+  }
+
+  for (uint i = address & ~1; i < address + cached; i += 2) {
+    machine->decodeCache[(i >> 1) & (decodeCacheSize - 1)].state = decodedEmpty;
+  }
+
+  for (uint page = address >> codePageShift;
+       (page <= ((address + length - 1) >> codePageShift)) &&
+       (page < (memSize >> codePageShift));
+       page++) {
+    if (machine->codePage[page]) {
+      flushBlocks();  // Writing into translated code
+      break;
+    }
+  }
+}
+
+/**
+ * @brief Discards every translated block.
+ */
+void flushBlocks() {
+  machine->blockGeneration++;
+  for (uint i = 0; i < (memSize >> codePageShift); i++) {
+    machine->codePage[i] = false;
+  }
+}
+
+/**
+ * @brief Starts recording executed instructions into a ring of records in a
+ * (mapped) trace file.
+ * @param path
+ * @param records Size of the ring, rounded up to a power of 2
+ * @return true if the file could be made
+ */
+bool startTrace(const char* path, uint records) {
+  uint capacity = 1;
+
+  while ((capacity < records) && (capacity < 0X80000000)) {
+    capacity = capacity << 1;
+  }
+
+  const size_t length = sizeof(traceHeader) + capacity * sizeof(traceRecord);
+  const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+  if (fd < 0) {
+    return false;
+  }
+  if (ftruncate(fd, length) != 0) {
+    close(fd);
+    return false;
+  }
+
+  void* mapped = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);  // The mapping keeps the file
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+
+  stopTrace();
+  machine->trace = (traceHeader*)mapped;
+  machine->traceRing = (traceRecord*)(machine->trace + 1);
+  memcpy(machine->trace->magic, traceMagic, sizeof(traceMagic));
+  machine->trace->version = traceVersion;
+  machine->trace->recordSize = sizeof(traceRecord);
+  machine->trace->capacity = capacity;
+  machine->trace->written = 0;
+  return true;
+}
+
+/**
+ * @brief Stops tracing, leaving the trace file as it is.
+ */
+void stopTrace() {
+  if (machine->trace != NULL) {
+    munmap(machine->trace, sizeof(traceHeader) + machine->trace->capacity *
+                                                     sizeof(traceRecord));
+    machine->trace = NULL;
+  }
+}
+
+/**
+ * @brief Claims the next record of the trace ring, overwriting the oldest
+ * once it is full.
+ * @return traceRecord* Cleared
+ */
+traceRecord* nextTraceRecord() {
+  traceRecord* record =
+      &machine->traceRing[machine->trace->written++ &
+                          (machine->trace->capacity - 1)];
+
+  memset(record, 0, sizeof(traceRecord));
+  return record;
+}
+
+/**
+ * @brief Starts counting executions of each instruction address from zero,
+ * or stops counting.
+ * @param enable
+ */
+void setProfiling(bool enable) {
+  if (enable) {
+    machine->profile.reset(new uint[memSize >> 1]());
+  } else {
+    machine->profile.reset();
+  }
+}
+
+/**
+ * @brief Finds the most executed instruction addresses.
+ * @param max The most to return
+ * @return std::vector<std::pair<uint, uint>> Address and count pairs, hottest
+ * first; empty if not profiling.
+ */
+std::vector<std::pair<uint, uint>> hotSpots(uint max) {
+  std::vector<std::pair<uint, uint>> spots;
+
+  if (machine->profile) {
+    for (uint i = 0; i < (memSize >> 1); i++) {
+      if (machine->profile[i] != 0) {
+        spots.push_back(std::make_pair(i << 1, machine->profile[i]));
+      }
+    }
+  }
+
+  const auto hotter = [](const std::pair<uint, uint>& a,
+                         const std::pair<uint, uint>& b) {
+    return (a.second > b.second) ||
+           ((a.second == b.second) && (a.first < b.first));
+  };
+  max = std::min(max, (uint)spots.size());
+  std::partial_sort(spots.begin(), spots.begin() + max, spots.end(), hotter);
+  spots.resize(max);
+  return spots;
+}
+
+/**
+ * @brief Describes the hottest instructions, with their source text from the
+ * .kmd file, one per line.
+ * @param pathToKMD
+ * @param max The most to list
+ * @param report Appended to
+ */
+void profileReport(const char* pathToKMD, uint max, std::string* report) {
+  const std::vector<std::pair<uint, uint>> spots = hotSpots(max);
+  std::unordered_map<uint, std::string> text;
+  FILE* kmd = fopen(pathToKMD, "r");
+  char line[0X400];
+
+  for (const std::pair<uint, uint>& spot : spots) {
+    text[spot.first] = "";
+  }
+
+  while ((kmd != NULL) && (fgets(line, sizeof(line), kmd) != NULL)) {
+    char* end;
+    const uint address = strtoul(line, &end, 16);
+    char* source = strchr(line, ';');
+
+    if ((end != line) && (*end == ':') && (source != NULL) &&
+        (text.count(address) != 0)) {
+      source[strcspn(source, "\n")] = '\0';
+      text[address] = (source[1] == ' ') ? source + 2 : source + 1;
+    }
+  }
+  if (kmd != NULL) {
+    fclose(kmd);
+  }
+
+  for (const std::pair<uint, uint>& spot : spots) {
+    snprintf(line, sizeof(line), "%12u  %08X %s\n", spot.second, spot.first,
+             text[spot.first].c_str());
+    *report += line;
+  }
+}
+
+/**
+ * @brief Copies the registers, breakpoints, terminals etc. between a machine
+ * and a snapshot, which name them alike. Memory is dealt with separately.
+ * @param to
+ * @param from
+ */
+template <typename To, typename From>
+void copyMachineState(To* to, const From* from) {
+  memcpy(to->breakpoints, from->breakpoints, sizeof(to->breakpoints));
+  memcpy(to->watchpoints, from->watchpoints, sizeof(to->watchpoints));
+  memcpy(to->emulBPFlag, from->emulBPFlag, sizeof(to->emulBPFlag));
+  memcpy(to->emulWPFlag, from->emulWPFlag, sizeof(to->emulWPFlag));
+
+  to->status = from->status;
+  to->oldStatus = from->oldStatus;
+  to->stepsToGo = from->stepsToGo;
+  to->stepsReset = from->stepsReset;
+
+  memcpy(to->r, from->r, sizeof(to->r));  // Banks are swapped with cpsr
+  memcpy(to->usrR, from->usrR, sizeof(to->usrR));
+  memcpy(to->fiqR, from->fiqR, sizeof(to->fiqR));
+  memcpy(to->irqR, from->irqR, sizeof(to->irqR));
+  memcpy(to->supR, from->supR, sizeof(to->supR));
+  memcpy(to->abtR, from->abtR, sizeof(to->abtR));
+  memcpy(to->underR, from->underR, sizeof(to->underR));
+  to->cpsr = from->cpsr;
+  memcpy(to->spsr, from->spsr, sizeof(to->spsr));
+
+  to->flagNZPending = from->flagNZPending;
+  to->flagCV = from->flagCV;
+  to->flagResult = from->flagResult;
+  to->flagA = from->flagA;
+  to->flagB = from->flagB;
+  to->flagCarry = from->flagCarry;
+
+  to->runUntilPC = from->runUntilPC;
+  to->runUntilSP = from->runUntilSP;
+  to->runUntilMode = from->runUntilMode;
+  to->runUntilStatus = from->runUntilStatus;
+  to->nextFileHandle = from->nextFileHandle;
+  to->lastAddr = from->lastAddr;
+  memcpy(to->pastOpcAddr, from->pastOpcAddr, sizeof(to->pastOpcAddr));
+  to->pastCount = from->pastCount;
+  to->BLPrefix = from->BLPrefix;
+
+  to->terminal0Tx = from->terminal0Tx;
+  to->terminal0Rx = from->terminal0Rx;
+  to->terminal1Tx = from->terminal1Tx;
+  to->terminal1Rx = from->terminal1Rx;
+}
+
+/**
+ * @brief Records the machine's state so that restoreSnapshot() can return to
+ * it. No memory is copied yet; pages are saved as they are first written.
+ */
+void takeSnapshot() {
+  machine->snapshot.reset(new Snapshot());
+  copyMachineState(machine->snapshot.get(), machine);
+
+  for (uint i = 0; i < snapshotPages / 32; i++) {
+    machine->cleanPages[i] = 0XFFFFFFFF;
+  }
+}
+
+/**
+ * @brief Returns the machine to its snapshot. Only pages written since the
+ * snapshot, or the last restore, are copied back.
+ * @return int The number of pages copied, or -1 if there is no snapshot.
+ */
+int restoreSnapshot() {
+  const Snapshot* snapshot = machine->snapshot.get();
+  int copied = 0;
+
+  if (snapshot == NULL) {
+    return -1;
+  }
+
+  for (uint page = 0; page < snapshotPages; page++) {
+    if ((machine->cleanPages[page >> 5] & (1 << (page & 31))) == 0) {
+      const uint address = page << snapshotPageShift;
+
+      memcpy(&machine->memory[address], snapshot->pages[page].data(),
+             1 << snapshotPageShift);
+      invalidateDecodeCache(address, 1 << snapshotPageShift);
+      copied++;
+    }
+  }
+  for (uint i = 0; i < snapshotPages / 32; i++) {
+    machine->cleanPages[i] = 0XFFFFFFFF;
+  }
+
+  copyMachineState(machine, snapshot);
+  indexBreakpoints();
+  indexWatchpoints();
+  return copied;
+}
+
+/**
+ * @brief Called before memory is written, so that the snapshot (if any) can
+ * keep the pages concerned as they were.
+ * @param address
+ * @param length
+ */
+void preservePages(uint address, uint length) {
+  for (uint page = address >> snapshotPageShift;
+       page <= ((address + length - 1) >> snapshotPageShift); page++) {
+    if ((page < snapshotPages) &&
+        ((machine->cleanPages[page >> 5] & (1 << (page & 31))) != 0)) {
+      savePage(page);
+    }
+  }
+}
+
+/**
+ * @brief Marks a page as written, first keeping its contents in the snapshot
+ * unless that was done before an earlier restore (they are the same).
+ * @param page
+ */
+void savePage(uint page) {
+  std::vector<uchar>* saved = &machine->snapshot->pages[page];
+
+  if (saved->empty()) {
+    const uchar* start = &machine->memory[page << snapshotPageShift];
+    saved->assign(start, start + (1 << snapshotPageShift));
+  }
+  machine->cleanPages[page >> 5] &= ~(1 << (page & 31));
+}
+
+/**
+ * @brief The block engine is only used when the monitor needs nothing it
+ * cannot supply: no running through BL/SWI, no partial steps.
+ * @return true
+ * @return false
+ */
+bool blockEngineUsable() {
+  return ((machine->status == CLIENT_STATE_RUNNING) ||
+          (machine->status == CLIENT_STATE_STEPPING)) &&
+         !machine->runThroughBL && !machine->runThroughSWI;
+}
+
+/**
+ * @brief Instructions which the block engine leaves to the single stepping
+ * path: SWIs (which may block on the terminal), exceptions and explicit
+ * changes of mode.
+ * @param decoded
+ * @return true
+ * @return false
+ */
+bool needsFallback(const decodedInstruction* decoded) {
+  if (decoded->state == decodedThumb) {
+    return ((decoded->opCode & 0XFF00) == 0XDF00) /* SWI */
+           || ((decoded->opCode & 0XFF00) == 0XBE00); /* Breakpoint */
+  }
+
+  return (decoded->handler == opCodeHandler<mySystem>) ||
+         (decoded->handler == opCodeHandler<msr>) ||
+         (decoded->handler == noOperandHandler<undefined>) ||
+         (decoded->handler == noOperandHandler<breakpoint>);
+}
+
+/**
+ * @brief Instructions after which the PC is not (necessarily) sequential.
+ * @param decoded
+ * @return true
+ * @return false
+ */
+bool endsBlock(const decodedInstruction* decoded) {
+  const uint opCode = decoded->opCode;
+
+  if (decoded->state == decodedThumb) {
+    return ((opCode & 0XF000) == 0XD000)     /* Conditional branch */
+           || ((opCode & 0XE000) == 0XE000)  /* B, BL, BLX */
+           || ((opCode & 0XFF00) == 0X4700)  /* BX */
+           || ((opCode & 0XFF00) == 0XBD00)  /* POP {.., PC} */
+           || (((opCode & 0XFC00) == 0X4400) &&  /* High register op. */
+               ((((opCode & 0X0080) >> 4) | (opCode & 7)) == 15));
+  }
+
+  return (decoded->handler == branch) || (decoded->handler == bxInstruction) ||
+         (decoded->rd == 15) ||
+         ((decoded->handler == opCodeHandler<multiple>) &&
+          ((opCode & 0X00008000) != 0));
+}
+
+/**
+ * @brief A flag setting instruction and the branch after it, run as one
+ * instruction: the branch condition is checked against the deferred flags,
+ * which are left deferred, rather than against cpsr.
+ * @tparam first Handler of the flag setting instruction
+ * @tparam second Handler of the branch
+ * @param decoded The first; the branch follows it
+ */
+template <instructionHandler first, instructionHandler second>
+void fusedPair(const decodedInstruction* decoded) {
+  incPC();
+  first(decoded);
+  incPC();
+  if ((decoded[1].cond == 0XE) || checkPendingCC(decoded[1].cond)) {
+    second(&decoded[1]);
+  }
+}
+
+constexpr const uint fusableOperations[6] = {0X2, 0X4, 0X8, 0X9, 0XA, 0XB};
+
+/**
+ * @brief The flag setting data processing handlers which fuse with a branch
+ * (SUBS, ADDS, TST, TEQ, CMP and CMN, in every operand form), alone or fused.
+ * Index / 9 selects the operation and index % 9 the operand form, 0 to
+ * operandImmediate.
+ * @tparam fused
+ * @return constexpr std::array<instructionHandler, 6 * 9>
+ */
+template <bool fused, uint... index>
+constexpr std::array<instructionHandler, sizeof...(index)> fusableDataOps(
+    std::integer_sequence<uint, index...>) {
+  return {{(fused ? fusedPair<normalDataOp<fusableOperations[index / 9],
+                                           index % 9, true>,
+                              branch>
+                  : normalDataOp<fusableOperations[index / 9], index % 9,
+                                 true>)...}};
+}
+
+/**
+ * @brief The fused handler for an instruction and the one after it: a
+ * compare, or a flag setting add or subtract, followed by a branch.
+ * @param decoded The first; the second follows it
+ * @return instructionHandler NULL if the pair is not fused
+ */
+instructionHandler fusedHandlerFor(const decodedInstruction* decoded) {
+  constexpr const std::array<instructionHandler, 6 * 9> armFirsts =
+      fusableDataOps<false>(std::make_integer_sequence<uint, 6 * 9>());
+  constexpr const std::array<instructionHandler, 6 * 9> armFused =
+      fusableDataOps<true>(std::make_integer_sequence<uint, 6 * 9>());
+  constexpr const instructionHandler thumbFirsts[] = {
+      thumbImmediate<1>,          thumbImmediate<2>,
+      thumbImmediate<3>,          thumbAddSub<true, true>,
+      thumbAddSub<false, true>,   thumbDataOp<0X8>,
+      thumbDataOp<0XA>,           thumbDataOp<0XB>};
+  constexpr const instructionHandler thumbFused[] = {
+      fusedPair<thumbImmediate<1>, thumbBranch>,
+      fusedPair<thumbImmediate<2>, thumbBranch>,
+      fusedPair<thumbImmediate<3>, thumbBranch>,
+      fusedPair<thumbAddSub<true, true>, thumbBranch>,
+      fusedPair<thumbAddSub<false, true>, thumbBranch>,
+      fusedPair<thumbDataOp<0X8>, thumbBranch>,
+      fusedPair<thumbDataOp<0XA>, thumbBranch>,
+      fusedPair<thumbDataOp<0XB>, thumbBranch>};
+  const decodedInstruction* next = &decoded[1];
+
+  if (decoded->cond != 0XE) {
+    return NULL; /* Conditional, so may not set the flags */
+  }
+
+  if (decoded->state == decodedThumb) {
+    if ((next->handler == thumbBranch) && (next->cond != 0XF)) {
+      for (uint i = 0; i < sizeof(thumbFirsts) / sizeof(thumbFirsts[0]); i++) {
+        if (decoded->handler == thumbFirsts[i]) {
+          return thumbFused[i];
+        }
+      }
+    }
+  } else if ((decoded->rd != 15) && (next->handler == branch) &&
+             (next->cond < 0XE) && ((next->opCode & linkMask) == 0)) {
+    for (uint i = 0; i < armFirsts.size(); i++) {
+      if (decoded->handler == armFirsts[i]) {
+        return armFused[i];
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Translates the straight-line code starting at an address.
+ * @param block
+ * @param address
+ * @param state decodedARM or decodedThumb - the current instruction set
+ */
+void buildBlock(basicBlock* block, uint address, uchar state) {
+  const int length = instructionLength(machine->cpsr, tfMask);
+
+  block->address = address;
+  block->state = state;
+  block->generation = machine->blockGeneration;
+  block->length = 0;
+  block->next[0] = NULL;
+  block->next[1] = NULL;
+
+  while ((block->length < blockMaxLength) && (address < memSize)) {
+    decodedInstruction* decoded = &block->instructions[block->length];
+    uint opCode = readMemory(address, length, false, false, memInstruction);
+
+    decode(opCode, decoded);
+    decoded->address = address;
+    decoded->state = state;
+
+    if (needsFallback(decoded)) {
+      break;
+    }
+
+    block->breakpoint[block->length] =
+        checkBreakpoint(address, decoded->opCode);
+    machine->codePage[address >> codePageShift] = true;
+    block->length++;
+    address += length;
+
+    if (endsBlock(decoded)) {
+      break;
+    }
+  }
+
+  block->fused = NULL; /* Not with a breakpoint between the two */
+  if ((block->length >= 2) && !block->breakpoint[block->length - 1]) {
+    block->fused = fusedHandlerFor(&block->instructions[block->length - 2]);
+  }
+}
+
+/**
+ * @brief Finds (or translates) the block starting at an address.
+ * @param address
+ * @return basicBlock* NULL if the first instruction needs the fallback path.
+ */
+basicBlock* lookupBlock(uint address) {
+  const uchar state =
+      ((machine->cpsr & tfMask) != 0) ? decodedThumb : decodedARM;
+  basicBlock* block =
+      &machine->blockCache[(address >> 1) & (blockCacheSize - 1)];
+
+  if ((block->address != address) || (block->state != state) ||
+      (block->generation != machine->blockGeneration)) {
+    buildBlock(block, address, state);
+  }
+
+  return (block->length != 0) ? block : NULL;
+}
+
+/**
+ * @brief Runs chained basic blocks, keeping the same accounting as step().
+ * @param maxBlocks Number of blocks to run before returning to the monitor.
+ * @return uint The number of instructions executed.
+ */
+uint runBlocks(uint maxBlocks) {
+  basicBlock* block = lookupBlock(machine->r[15]);
+  uint done = 0;
+
+  if (block == NULL) {
+    step(); /* Can't translate here; leave it to the general case */
+    return 1;
+  }
+
+  while (maxBlocks-- > 0) {
+    const uint generation = machine->blockGeneration;
+    const uint mode = machine->cpsr & (tfMask | modeMask);
+    const int length = instructionLength(machine->cpsr, tfMask);
+
+    for (uint i = 0; i < block->length; i++) {
+      const decodedInstruction* decoded = &block->instructions[i];
+
+      machine->oldStatus = machine->status;
+      if (machine->breakpointEnabled && block->breakpoint[i]) {
+        machine->status = CLIENT_STATE_BREAKPOINT;
+        machine->breakpointEnabled = false;
+        return done;
+      }
+      machine->breakpointEnabled = machine->breakpointEnable;
+
+      if ((i + 2 == block->length) && (block->fused != NULL) &&
+          (machine->profile == NULL) && (machine->trace == NULL) &&
+          (machine->stepsToGo != 1)) {
+        /* The last two as one; neither can stop the machine */
+        machine->lastAddr = decoded[1].address;
+        noteFetchAddress(decoded->address);
+        noteFetchAddress(decoded[1].address);
+        block->fused(decoded);
+        done += 2;
+
+        machine->stepsReset += 2;
+        if ((machine->stepsToGo > 0) && ((machine->stepsToGo -= 2) == 0)) {
+          machine->status = CLIENT_STATE_STOPPED;
+          machine->breakpointEnabled = false;
+          return done;
+        }
         break;
+      }
+
+      machine->lastAddr = decoded->address;
+      noteFetchAddress(decoded->address);
+      execute(decoded);
+      done++;
+
+      if ((machine->status & CLIENT_STATE_CLASS_MASK) !=
+          CLIENT_STATE_CLASS_RUNNING) {
+        machine->breakpointEnabled = false;  // No longer running
+        return done;
+      }
+
+      machine->stepsReset++;
+      if ((machine->stepsToGo > 0) && (--machine->stepsToGo == 0)) {
+        machine->status = CLIENT_STATE_STOPPED;
+        machine->breakpointEnabled = false;
+        return done;
+      }
+
+      if (((uint)machine->r[15] != decoded->address + length) ||
+          ((machine->cpsr & (tfMask | modeMask)) != mode) ||
+          (machine->blockGeneration != generation)) {
+        break; /* Left the block early */
+      }
     }
-  } else {
-    /* Check condition */
-    if ((checkCC(opCode >> 28) == true) ||
-        ((opCode & 0XFE000000) == 0XFA000000)) /* Nasty non-orthogonal BLX */
-    {
-      switch ((opCode >> 25) & 0X00000007) {
-        case 0X0:
-          dataOp(opCode);
-          break; /* includes load/store hw & sb */
-        case 0X1:
-          dataOp(opCode);
-          break; /* data processing & MSR # */
-        case 0X2:
-          transfer(opCode);
-          break;
-        case 0X3:
-          transfer(opCode);
-          break;
-        case 0X4:
-          multiple(opCode);
-          break;
-        case 0X5:
-          branch(opCode);
-          break;
-        case 0X6:
-          undefined();
-          break;
-        case 0X7:
-          mySystem(opCode);
-          break;
+
+    if (machine->blockGeneration != generation) {
+      return done;
+    }
+
+    /* Chain on to the successor, remembering it for next time */
+    const uint taken =
+        ((uint)machine->r[15] != block->address + block->length * length);
+    basicBlock* next = block->next[taken];
+    const uchar state =
+        ((machine->cpsr & tfMask) != 0) ? decodedThumb : decodedARM;
+
+    if ((next == NULL) || (next->address != (uint)machine->r[15]) ||
+        (next->state != state) ||
+        (next->generation != machine->blockGeneration)) {
+      next = lookupBlock(machine->r[15]);
+      if (next == NULL) {
+        return done; /* The next step() will deal with it */
       }
+      block->next[taken] = next;
     }
+    block = next;
   }
+
+  return done;
 }
 
 /**
@@ -1103,55 +3012,15 @@ int isItSBHW(uint opCode) {
     return false;
 }
 
-/**
- * @brief
- * @param opCode
- */
-void dataOp(uint opCode) {
-  int operation;
-
-  if (((opCode & mulMask) == mulOp) || ((opCode & longMulMask) == longMulOp)) {
-    myMulti(opCode);
-  } else if (isItSBHW(opCode) == true) {
-    transferSBHW(opCode);
-  } else if ((opCode & swpMask) == swpOp) {
-    swap(opCode);
-  } else {
-    operation = (opCode & dataOpMask) >> 21;
-
-    /* TST, TEQ, CMP, CMN - all lie in following range, but have S set */
-    if ((opCode & dataExtMask) == arithExt) /* PSR transfers OR BX */
-    {
-      if ((opCode & 0X0FBF0FFF) == 0X010F0000) {
-        mrs(opCode); /* MRS */
-      } else if (((opCode & 0X0DB6F000) == 0X0120F000) &&
-                 ((opCode & 0X02000010) != 0X00000010)) {
-        msr(opCode);                                  /* MSR */
-      } else if ((opCode & 0X0FFFFFD0) == 0X012FFF10) /* BX/BLX */
-      {
-        bx(opCode & rmMask, opCode & 0X00000020);
-      } else if ((opCode & 0XFFF000F0) == 0XE1200070) {
-        breakpoint(); /* Breakpoint */
-      } else if ((opCode & 0X0FFF0FF0) == 0X016F0F10) {
-        clz(opCode); /* CLZ */
-      } else {
-        undefined();
-      }
-    } else {
-      normalDataOp(opCode, operation); /* All data processing operations */
-    }
-  }
-}
-
 /**
  * @brief
  * @param opCode
  */
 void transferSBHW(uint opCode) {
   uint address;
-  int size;
+  int size = 0;
   int offset, rd;
-  bool sign;
+  bool sign = false;
 
   switch (opCode & 0X00000060) {
     case 0X00:
@@ -1199,10 +3068,12 @@ void transferSBHW(uint opCode) {
  * @param opCode
  */
 void mrs(uint opCode) {
+  materialiseFlags();
   if ((opCode & 0X00400000) == 0) {
-    putRegister((opCode & rdMask) >> 12, cpsr, regCurrent);
+    putRegister((opCode & rdMask) >> 12, machine->cpsr, regCurrent);
   } else {
-    putRegister((opCode & rdMask) >> 12, spsr[cpsr & modeMask], regCurrent);
+    putRegister((opCode & rdMask) >> 12,
+                machine->spsr[machine->cpsr & modeMask], regCurrent);
   }
 }
 
@@ -1211,7 +3082,7 @@ void mrs(uint opCode) {
  * @param opCode
  */
 void msr(uint opCode) {
-  int mask, source;
+  int mask = 0, source;
 
   switch (opCode & 0X00090000) {
     case 0X00000000:
@@ -1227,7 +3098,7 @@ void msr(uint opCode) {
       mask = 0XFFFFFFFF;
       break;
   }
-  if ((cpsr & modeMask) == 0X10)
+  if ((machine->cpsr & modeMask) == 0X10)
     mask = mask & 0XF0000000; /* User mode */
 
   if ((opCode & immMask) == 0) /* Test applies for both cases */
@@ -1241,10 +3112,13 @@ void msr(uint opCode) {
     source = ((x >> y) | lsl(x, 32 - y, &dummy)) & mask;
   }
 
-  if ((opCode & 0X00400000) == 0)
-    cpsr = (cpsr & ~mask) | source;
-  else
-    spsr[cpsr & modeMask] = (spsr[cpsr & modeMask] & ~mask) | source;
+  if ((opCode & 0X00400000) == 0) {
+    materialiseFlags();
+    setCPSR((machine->cpsr & ~mask) | source);
+  } else {
+    uint* spsr = &machine->spsr[machine->cpsr & modeMask];
+    *spsr = (*spsr & ~mask) | source;
+  }
 }
 
 /**
@@ -1257,7 +3131,7 @@ void bx(uint rm, int link) {
 
   int PC = getRegister(15, regCurrent);
 
-  if ((cpsr & tfMask) != 0) {
+  if ((machine->cpsr & tfMask) != 0) {
     PC = PC - 2;
     PC = PC | 1;
   } /* Remember Thumb mode */
@@ -1269,9 +3143,9 @@ void bx(uint rm, int link) {
   t_bit = getRegister(rm, regCurrent) & 0X00000001;
 
   if (t_bit == 1)
-    cpsr = cpsr | tfMask;
+    machine->cpsr = machine->cpsr | tfMask;
   else
-    cpsr = cpsr & ~tfMask;
+    machine->cpsr = machine->cpsr & ~tfMask;
 
   putRegister(15, offset, regCurrent); /* Update PC */
 
@@ -1285,12 +3159,12 @@ void bx(uint rm, int link) {
  * @param opCode
  */
 void myMulti(uint opCode) {
-  int acc;
+  uint acc;
 
   // Normal
   if ((opCode & mulLongBit) == 0) {
-    acc = getRegister(opCode & rmMask, regCurrent) *
-          getRegister((opCode & rsMask) >> 8, regCurrent);
+    acc = wordMultiply(getRegister(opCode & rmMask, regCurrent),
+                       getRegister((opCode & rsMask) >> 8, regCurrent));
 
     if ((opCode & mulAccBit) != 0)
       acc = acc + getRegister((opCode & rdMask) >> 12, regCurrent);
@@ -1299,61 +3173,26 @@ void myMulti(uint opCode) {
 
     if ((opCode & sMask) != 0)
       setNZ(acc); /* Flags */
-  } else          /* Long */
-  {
-    uint Rm, Rs, th, tm, tl;
-    int sign;
+  } else { /* Long */
+    uint64_t product = 0;
 
-    Rm = getRegister(opCode & rmMask, regCurrent);
-    Rs = getRegister((opCode & rsMask) >> 8, regCurrent);
+    if ((opCode & mulAccBit) != 0) { /* Accumulate RdHi:RdLo */
+      const uint64_t hi =
+          (uint)getRegister((opCode & rnMask) >> 16, regCurrent);
+      const uint lo = getRegister((opCode & rdMask) >> 12, regCurrent);
 
-    sign = 0;
-    if ((opCode & mulSignBit) != 0) /* Signed */
-    {
-      if ((Rm & bit31) != 0) {
-        Rm = ~Rm + 1;
-        sign = 1;
-      }
-      if ((Rs & bit31) != 0) {
-        Rs = ~Rs + 1;
-        sign = sign ^ 1;
-      }
-    }
-    /* Everything now `positive' */
-    tl = (Rm & 0X0000FFFF) * (Rs & 0X0000FFFF);
-    th = ((Rm >> 16) & 0X0000FFFF) * ((Rs >> 16) & 0X0000FFFF);
-    tm = ((Rm >> 16) & 0X0000FFFF) * (Rs & 0X0000FFFF);
-    Rm =
-        ((Rs >> 16) & 0X0000FFFF) * (Rm & 0X0000FFFF); /* Rm no longer needed */
-    tm = tm + Rm;
-    if (tm < Rm)
-      th = th + 0X00010000; /* Propagate carry */
-    tl = tl + (tm << 16);
-    if (tl < (tm << 16))
-      th = th + 1;
-    th = th + ((tm >> 16) & 0X0000FFFF);
-
-    if (sign != 0) /* Change sign of result */
-    {
-      th = ~th;
-      tl = ~tl + 1;
-      if (tl == 0)
-        th = th + 1;
+      product = (hi << 32) | lo;
     }
 
-    if ((opCode & mulAccBit) != 0) {
-      tm = tl + getRegister((opCode & rdMask) >> 12, regCurrent);
-      if (tm < tl)
-        th = th + 1; /* Propagate carry */
-      tl = tm;
-      th = th + getRegister((opCode & rnMask) >> 16, regCurrent);
-    }
+    product = longMultiply(getRegister(opCode & rmMask, regCurrent),
+                           getRegister((opCode & rsMask) >> 8, regCurrent),
+                           (opCode & mulSignBit) != 0, product);
 
-    putRegister((opCode & rdMask) >> 12, tl, regCurrent);
-    putRegister((opCode & rnMask) >> 16, th, regCurrent);
+    putRegister((opCode & rdMask) >> 12, (uint)product, regCurrent);
+    putRegister((opCode & rnMask) >> 16, (uint)(product >> 32), regCurrent);
 
     if ((opCode & sMask) != 0)
-      setNZ(th | (((tl >> 16) | tl) & 0X0000FFFF)); /* Flags */
+      setNZ(longMultiplyNZ(product)); /* Flags */
   }
 }
 
@@ -1378,28 +3217,31 @@ void swap(uint opCode) {
 }
 
 /**
- * @brief
- * @param opCode
- * @param operation
+ * @brief Data processing, specialised for each ALU function and form.
+ * @tparam operation ALU function code
+ * @tparam operand Op. code bits 6:4 for a shifted register; operandImmediate
+ * for a rotated immediate, which was rotated when decoded
+ * @tparam setsFlags The S bit
+ * @param decoded
  */
-void normalDataOp(uint opCode, int operation) {
-  int rd, a, b, mode;
+template <uint operation, uint operand, bool setsFlags>
+void normalDataOp(const decodedInstruction* decoded) {
+  int rd, a, b, carry;
   int shift_carry;
-  int CPSR_special;
 
-  mode = cpsr & modeMask;
-  CPSR_special = false;
-  shift_carry = 0;
-  a = getRegister((opCode & rnMask) >> 16,
-                  regCurrent);  // force_user = false
+  a = getRegister(decoded->rn, regCurrent);  // force_user = false
 
-  if ((opCode & immMask) == 0) {
-    b = bReg(opCode & op2Mask, &shift_carry);
+  if (operand == operandImmediate) {
+    b = decoded->offset;
+    shift_carry = decoded->shiftCarry;
   } else {
-    b = bImmediate(opCode & op2Mask, &shift_carry);
+    b = shiftedRegister<operand>(decoded->opCode, &shift_carry);
+  }
+
+  if ((operation == 0X5) || (operation == 0X6) || (operation == 0X7)) {
+    carry = carryFlag();
   }
 
-  // R15s
   switch (operation) {
     case 0X0:
       rd = a & b;
@@ -1417,33 +3259,20 @@ void normalDataOp(uint opCode, int operation) {
       rd = a + b;
       break;  // ADD
     case 0X5:
-      rd = a + b;
-      if ((cpsr & cfMask) != 0)
-        rd = rd + 1;
+      rd = a + b + (carry ? 1 : 0);
       break;  // ADC
     case 0X6:
-      rd = a - b - 1;
-      if ((cpsr & cfMask) != 0)
-        rd = rd + 1;
+      rd = a - b - (carry ? 0 : 1);
       break;  // SBC
     case 0X7:
-      rd = b - a - 1;
-      if ((cpsr & cfMask) != 0)
-        rd = rd + 1;
+      rd = b - a - (carry ? 0 : 1);
       break;  // RSC
     case 0X8:
       rd = a & b;
       break;  // TST
     case 0X9:
-      rd = a ^ b;  // TEQ
-
-      // TEQP
-      if ((opCode & rdMask) == 0XF000) {
-        CPSR_special = true;
-        if (mode != userMode)
-          cpsr = spsr[mode];
-      }
-      break;
+      rd = a ^ b;
+      break;  // TEQ
     case 0XA:
       rd = a - b;
       break;  // CMP
@@ -1466,66 +3295,137 @@ void normalDataOp(uint opCode, int operation) {
 
   // Return result unless a compare
   if ((operation & 0XC) != 0X8) {
-    putRegister((opCode & rdMask) >> 12, rd, regCurrent);
+    putRegister(decoded->rd, rd, regCurrent);
   }
 
   // S-bit && Want to change CPSR
-  if (((opCode & sMask) != 0) && (CPSR_special != true)) {
-    // PC and S-bit
-    if (((opCode & rdMask) >> 12) == 0XF) {
-      // restore saved CPSR
-      if (mode != userMode) {
-        cpsr = spsr[mode];
-      } else {
-        fprintf(stderr, "SPSR_user read attempted\n");
-      }
+  if (!setsFlags) {
+    return;
+  }
+
+  // PC and S-bit (including TEQP): restore saved CPSR
+  if (decoded->rd == 0XF) {
+    const uint mode = machine->cpsr & modeMask;
+
+    if (mode != userMode) {
+      setCPSR(machine->spsr[mode]);
+    } else if (operation != 0X9) {
+      fprintf(stderr, "SPSR_user read attempted\n");
     }
-    // other dest. registers
-    else {
-      switch (operation) {  // LOGICALs
-        case 0X0:           // AND
-        case 0X1:           // EOR
-        case 0X8:           // TST
-        case 0X9:           // TEQ
-        case 0XC:           // ORR
-        case 0XD:           // MOV
-        case 0XE:           // BIC
-        case 0XF:           // MVN
-          setNZ(rd);
-          if (shift_carry == true) {
-            cpsr = cpsr | cfMask;  // CF := output
-          } else {
-            cpsr = cpsr & ~cfMask;  // from shifter
-          }
-          break;
+    return;
+  }
 
-        case 0X2:  // SUB
-        case 0XA:  // CMP
-          setFlags(flagSub, a, b, rd, 1);
-          break;
+  // other dest. registers
+  switch (operation) {  // LOGICALs
+    case 0X0:           // AND
+    case 0X1:           // EOR
+    case 0X8:           // TST
+    case 0X9:           // TEQ
+    case 0XC:           // ORR
+    case 0XD:           // MOV
+    case 0XE:           // BIC
+    case 0XF:           // MVN
+      setNZ(rd);
+      if (shift_carry != carryUnchanged) {
+        setCarry(shift_carry != 0);
+      }
+      break;
 
-        case 0X6:  // SBC - Needs more testing
-          setFlags(flagSub, a, b, rd, cpsr & cfMask);
-          break;
+    case 0X2:  // SUB
+    case 0XA:  // CMP
+      setFlags(flagSub, a, b, rd, 1);
+      break;
 
-        case 0X3:  // RSB
-          setFlags(flagSub, b, a, rd, 1);
-          break;
+    case 0X6:  // SBC - Needs more testing
+      setFlags(flagSub, a, b, rd, carry);
+      break;
 
-        case 0X7:  // RSC
-          setFlags(flagSub, b, a, rd, cpsr & cfMask);
-          break;
+    case 0X3:  // RSB
+      setFlags(flagSub, b, a, rd, 1);
+      break;
 
-        case 0X4:  // ADD
-        case 0XB:  // CMN
-          setFlags(flagAdd, a, b, rd, 0);
-          break;
+    case 0X7:  // RSC
+      setFlags(flagSub, b, a, rd, carry);
+      break;
+
+    case 0X4:  // ADD
+    case 0XB:  // CMN
+      setFlags(flagAdd, a, b, rd, 0);
+      break;
+
+    case 0X5:  // ADC
+      setFlags(flagAdd, a, b, rd, carry);
+      break;
+  }
+}
+
+/**
+ * @brief The shifted register operand of data processing, specialised for
+ * each shift form so that it comes down to a couple of inline operations.
+ * @tparam form Op. code bits 6:4: the shift type (00 = LSL, 01 = LSR,
+ * 10 = ASR, 11 = ROR) and whether a register holds the distance
+ * @param opCode
+ * @param cf Set to the carry-out: 0, 1 or carryUnchanged
+ * @return uint
+ */
+template <uint form>
+uint shiftedRegister(uint opCode, int* cf) {
+  const uint reg = getRegister(opCode & rmMask, regCurrent);
+  uint distance;
+
+  if ((form & 1) == 0) {
+    distance = (opCode >> 7) & 0X1F;
+  } else {
+    distance = getRegister((opCode >> 8) & 0XF, regCurrent) & 0XFF;
+  }
+
+  if (distance == 0) { /* Special cases */
+    switch (form) {
+      case 0X2: /* LSR #32 */
+        *cf = ((reg & bit31) != 0);
+        return 0;
+      case 0X4: /* ASR #32 */
+        *cf = ((reg & bit31) != 0);
+        return (int)reg >> 31;
+      case 0X6: /* RRX */
+        *cf = ((reg & bit0) != 0);
+        return (reg >> 1) | (carryFlag() ? bit31 : 0);
+      default: /* LSL #0, or by a register holding zero */
+        *cf = carryUnchanged;
+        return reg;
+    }
+  }
 
-        case 0X5:  // ADC
-          setFlags(flagAdd, a, b, rd, cpsr & cfMask);
-          break;
+  switch (form >> 1) {
+    case 0X0: /* LSL */
+      if (distance < 32) {
+        *cf = (((reg >> (32 - distance)) & bit0) != 0);
+        return reg << distance;
       }
-    }
+      *cf = (distance == 32) && ((reg & bit0) != 0);
+      return 0;
+    case 0X1: /* LSR */
+      if (distance < 32) {
+        *cf = (((reg >> (distance - 1)) & bit0) != 0);
+        return reg >> distance;
+      }
+      *cf = (distance == 32) && ((reg & bit31) != 0);
+      return 0;
+    case 0X2: /* ASR */
+      if (distance < 32) {
+        *cf = (((reg >> (distance - 1)) & bit0) != 0);
+        return (int)reg >> distance;
+      }
+      *cf = ((reg & bit31) != 0);
+      return (int)reg >> 31;
+    default: /* ROR */
+      distance = distance & 0X1F;
+      if (distance == 0) { /* By a multiple of 32 */
+        *cf = ((reg & bit31) != 0);
+        return reg;
+      }
+      *cf = (((reg >> (distance - 1)) & bit0) != 0);
+      return (reg >> distance) | (reg << (32 - distance));
   }
 }
 
@@ -1553,7 +3453,7 @@ int bReg(int op2, int* cf) {
     distance = (getRegister((op2 & 0XF00) >> 8, regCurrent) & 0XFF);
   /* Register value */
 
-  *cf = ((cpsr & cfMask) != 0); /* Previous carry */
+  *cf = carryFlag(); /* Previous carry */
   switch (shift_type) {
     case 0X0:
       result = lsl(reg, distance, cf);
@@ -1569,7 +3469,7 @@ int bReg(int op2, int* cf) {
       break;  /* ROR */
     case 0X4: /* RRX #1 */
       result = reg >> 1;
-      if ((cpsr & cfMask) == 0)
+      if (!carryFlag())
         result = result & ~bit31;
       else
         result = result | bit31;
@@ -1584,29 +3484,6 @@ int bReg(int op2, int* cf) {
   return result;
 }
 
-/**
- * @brief
- * @param op2
- * @param cf
- * @return int
- */
-int bImmediate(int op2, int* cf) {
-  uint x, y;
-  int dummy;
-
-  x = op2 & 0X0FF;        /* Immediate value */
-  y = (op2 & 0XF00) >> 7; /* Number of rotates */
-  if (y == 0)
-    *cf = ((cpsr & cfMask) != 0); /* Previous carry */
-  else
-    *cf = (((x >> (y - 1)) & bit0) != 0);
-  if (*cf)
-    *cf = true;
-  else
-    *cf = false;            /* Change to "bool" */
-  return ror(x, y, &dummy); /* Circular rotation */
-}
-
 /**
  * @brief
  * @param opCode
@@ -1724,29 +3601,22 @@ void multiple(uint opCode) {
 }
 
 /**
- * @brief
- * @param source
- * @param first
- * @return int
+ * @brief Whether a block transfer can go straight between the registers and
+ * memory: the words lie wholly in RAM and nothing (watchpoints, a trace or
+ * the Tube) needs to see them one at a time.
+ * @param address Lowest word, aligned
+ * @param count Words
+ * @param write
+ * @return bool
  */
-int bitCount(uint source, int* first) {
-  int count = 0;
-  int reg = 0;
-  *first = -1;
-
-  while (source != 0) {
-    if ((source & bit0) != 0) {
-      count = count + 1;
-      if (*first < 0) {
-        *first = reg;
-      }
-    }
-
-    source = source >> 1;
-    reg = reg + 1;
+bool directTransfer(uint address, uint count, bool write) {
+  if (!littleEndianHost || (address >= memSize) ||
+      (count > (memSize - address) / 4) || ((machine->runFlags & 0x20) != 0)) {
+    return false;
   }
-
-  return count;
+  return !write || ((machine->trace == NULL) &&
+                    ((machine->tubeAddress == 0) ||
+                     (machine->tubeAddress - address >= 4 * count)));
 }
 
 /**
@@ -1758,12 +3628,12 @@ int bitCount(uint source, int* first) {
  * @param hat
  */
 void ldm(int mode, int rn, int regList, bool writeBack, bool hat) {
-  int address, new_base, count, first_reg, reg, data;
+  int address, new_base = 0, count, data = 0;
   int force_user;
   bool r15_inc;  // internal `bool'
 
   address = getRegister(rn, regCurrent);
-  count = bitCount(regList, &first_reg);
+  count = __builtin_popcount(regList);
   r15_inc = (regList & 0X00008000) != 0;  // R15 in list
 
   switch (mode) {
@@ -1797,29 +3667,39 @@ void ldm(int mode, int rn, int regList, bool writeBack, bool hat) {
     force_user = regCurrent;
   }
 
-  reg = 0;
+  if (!hat && directTransfer(address, count, false)) {
+    uint words[16];
+    int i = 0;
+
+    memcpy(words, &machine->memory[address], 4 * count);
+    for (uint list = regList; list != 0; list = list & (list - 1)) {
+      const int reg = __builtin_ctz(list);
 
-  while (regList != 0) {
-    if ((regList & bit0) != 0) {
+      data = words[i++];
+      if (reg < 15) {
+        machine->r[reg] = data;
+      } else {
+        putRegister(15, data, regCurrent);
+      }
+    }
+  } else {
+    for (uint list = regList; list != 0; list = list & (list - 1)) {
       data = readMemory(address, 4, false, false, memData);  // Keep for later
-      putRegister(reg, data, force_user);
+      putRegister(__builtin_ctz(list), data, force_user);
       address = address + 4;
     }
-
-    regList = regList >> 1;
-    reg = reg + 1;
   }
 
   // R15 in list
   if (r15_inc) {
     if ((data & 1) != 0) {
-      cpsr = cpsr | tfMask;  // data left over from last load
+      machine->cpsr = machine->cpsr | tfMask;  // data left over from last load
     } else {
-      cpsr = cpsr & ~tfMask;  // used to set instruction set
+      machine->cpsr = machine->cpsr & ~tfMask;  // used to set instruction set
     }
 
     if (hat) {
-      cpsr = spsr[cpsr & modeMask];  // and if S bit set
+      setCPSR(machine->spsr[machine->cpsr & modeMask]);  // and if S bit set
     }
   }
 }
@@ -1833,12 +3713,12 @@ void ldm(int mode, int rn, int regList, bool writeBack, bool hat) {
  * @param hat
  */
 void stm(int mode, int rn, int regList, bool writeBack, bool hat) {
-  int address, new_base, count, first_reg, reg;
+  int address, new_base = 0, count;
   int force_user;
   bool special;
 
   address = getRegister(rn, regCurrent);
-  count = bitCount(regList, &first_reg);
+  count = __builtin_popcount(regList);
 
   switch (mode) {
     case 0:
@@ -1862,8 +3742,8 @@ void stm(int mode, int rn, int regList, bool writeBack, bool hat) {
 
   special = false;
   if (writeBack != 0) {
-    if (rn == first_reg) {
-      special = true;
+    if ((regList != 0) && (rn == __builtin_ctz(regList))) {
+      special = true;  // The first register stored: its old value goes
     } else {
       putRegister(rn, new_base, regCurrent);
     }
@@ -1875,16 +3755,24 @@ void stm(int mode, int rn, int regList, bool writeBack, bool hat) {
     force_user = regCurrent;
   }
 
-  reg = 0;
+  if (!hat && directTransfer(address, count, true)) {
+    uint words[16];
+    int i = 0;
+
+    for (uint list = regList; list != 0; list = list & (list - 1)) {
+      const int reg = __builtin_ctz(list);
 
-  while (regList != 0) {
-    if ((regList & bit0) != 0) {
-      writeMemory(address, getRegister(reg, force_user), 4, false, memData);
+      words[i++] = (reg < 15) ? machine->r[reg] : getRegister(15, regCurrent);
+    }
+    preservePages(address, 4 * count);
+    invalidateDecodeCache(address, 4 * count);
+    memcpy(&machine->memory[address], words, 4 * count);
+  } else {
+    for (uint list = regList; list != 0; list = list & (list - 1)) {
+      writeMemory(address, getRegister(__builtin_ctz(list), force_user), 4,
+                  false, memData);
       address = address + 4;
     }
-
-    regList = regList >> 1;
-    reg = reg + 1;
   }
 
   if (special)
@@ -1892,29 +3780,23 @@ void stm(int mode, int rn, int regList, bool writeBack, bool hat) {
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief B, BL and BLX (immediate); the offset is extracted when decoded.
+ * @param decoded
  */
-void branch(uint opCode) {
+void branch(const decodedInstruction* decoded) {
+  const uint opCode = decoded->opCode;
   int PC = getRegister(15, regCurrent);  // Get this now in case mode changes
 
   if (((opCode & linkMask) != 0) || ((opCode & 0XF0000000) == 0XF0000000)) {
     putRegister(14, getRegister(15, regCurrent) - 4, regCurrent);
   }
 
-  int offset = (opCode & branchField) << 2;
-
-  if ((opCode & branchSign) != 0) {
-    offset = offset | (~(branchField << 2) & 0XFFFFFFFC);  // sign extend
-  }
-
   // Other BLX fix-up
   if ((opCode & 0XF0000000) == 0XF0000000) {
-    offset = offset | ((opCode >> 23) & 2);
-    cpsr = cpsr | tfMask;
+    machine->cpsr = machine->cpsr | tfMask;
   }
 
-  putRegister(15, PC + offset, regCurrent);
+  putRegister(15, PC + decoded->offset, regCurrent);
 }
 
 /**
@@ -1924,11 +3806,16 @@ void branch(uint opCode) {
  * @return false
  */
 bool swiCharacterPrint(char c) {
-  while (!putBuffer(&terminal0Tx, c)) {
-    if (status == CLIENT_STATE_RESET) {
+  if (machine->batchMode) {
+    putc(c, machine->batchOut);
+    return true;
+  }
+
+  while (!putBuffer(&machine->terminal0Tx, c)) {
+    if (machine->status == CLIENT_STATE_RESET) {
       return false;
     } else {
-      comm(SWIPoll);  // If stalled, retain monitor communications
+      comm(SWIPoll, -1);  // Sleep until the monitor drains it (or resets)
     }
   }
 
@@ -1959,8 +3846,6 @@ int swiDecimalPrint(uint number) {
  * @param opCode
  */
 void mySystem(uint opCode) {
-  int temp;
-
   if (((opCode & 0X0F000000) == 0X0E000000)
       /* bodge to allow Thumb to use this code */
       || ((opCode & 0X0F000000) == 0X0C000000) ||
@@ -1968,9 +3853,10 @@ void mySystem(uint opCode) {
     fprintf(stderr, "whoops -undefined \n");
     undefined();
   } else {
-    if (printOut) {
+    if (machine->printOut) {
       fprintf(stderr, "\n*** SWI CALL %06X ***\n\n", opCode & 0X00FFFFFF);
     }
+    machine->yieldQuantum = true;  // Let the monitor collect output promptly
 
     switch (opCode & 0X00FFFFFF) {
       // Output character R0 (to terminal)
@@ -1978,7 +3864,7 @@ void mySystem(uint opCode) {
         putRegister(15, getRegister(15, regCurrent) - 8, regCurrent);
         swiCharacterPrint(getRegister(0, regCurrent) & 0XFF);
 
-        if (status != CLIENT_STATE_RESET) {
+        if (machine->status != CLIENT_STATE_RESET) {
           putRegister(15, getRegister(15, regCurrent),
                       regCurrent);  // Correct PC
         }
@@ -1986,15 +3872,27 @@ void mySystem(uint opCode) {
 
       // Input character R0 (from terminal)
       case 1: {
-        uchar c;
+        uchar c = 0;
         putRegister(15, getRegister(15, regCurrent) - 8, regCurrent);
         // Bodge PC so that stall looks `correct'
-        while ((!getBuffer(&terminal0Rx, &c)) &&
-               (status != CLIENT_STATE_RESET)) {
-          comm(SWIPoll);
+        if (machine->batchMode) {
+          fflush(machine->batchOut);  // Prompts should appear before we wait
+          int in = (machine->batchIn == NULL) ? EOF : getc(machine->batchIn);
+
+          if (in == EOF) {
+            machine->batchInputEnded = true;
+            machine->status = CLIENT_STATE_STOPPED;
+            break;  // Leave the PC on the SWI
+          }
+          c = in;
+        }
+
+        while (!machine->batchMode && (!getBuffer(&machine->terminal0Rx, &c)) &&
+               (machine->status != CLIENT_STATE_RESET)) {
+          comm(SWIPoll, -1);  // Sleep until the monitor sends some (or resets)
         }
 
-        if (status != CLIENT_STATE_RESET) {
+        if (machine->status != CLIENT_STATE_RESET) {
           putRegister(0, c & 0XFF, regCurrent);
           putRegister(15, getRegister(15, regCurrent),
                       regCurrent);  // Correct PC
@@ -2003,7 +3901,7 @@ void mySystem(uint opCode) {
 
       // Halt
       case 2:
-        status = CLIENT_STATE_BYPROG;
+        machine->status = CLIENT_STATE_BYPROG;
         break;
 
       // Print string @R0 (to terminal)
@@ -2014,12 +3912,12 @@ void mySystem(uint opCode) {
         char c;
         while (
             ((c = readMemory(str_ptr, 1, false, false, memSystem)) != '\0') &&
-            (status != CLIENT_STATE_RESET)) {
+            (machine->status != CLIENT_STATE_RESET)) {
           swiCharacterPrint(c);  // Returns if reset
           str_ptr++;
         }
 
-        if (status != CLIENT_STATE_RESET) {
+        if (machine->status != CLIENT_STATE_RESET) {
           putRegister(15, getRegister(15, regCurrent),
                       regCurrent);  // Correct PC
         }
@@ -2031,20 +3929,21 @@ void mySystem(uint opCode) {
         const uint number = getRegister(0, regCurrent);
         number == 0 ? swiCharacterPrint('0') : swiDecimalPrint(number);
 
-        if (status != CLIENT_STATE_RESET) {
+        if (machine->status != CLIENT_STATE_RESET) {
           putRegister(15, getRegister(15, regCurrent),
                       regCurrent);  // Correct PC
         }
       } break;
 
       default:
-        if (printOut) {
+        if (machine->printOut) {
           fprintf(stderr, "Un-trapped SWI call %06X\n", opCode & 0X00FFFFFF);
         }
 
-        spsr[supMode] = cpsr;
-        cpsr = (cpsr & ~modeMask) | supMode;
-        cpsr = cpsr & ~tfMask;  // Always in ARM mode
+        materialiseFlags();
+        machine->spsr[supMode] = machine->cpsr;
+        // Always ARM mode
+        setCPSR((machine->cpsr & ~modeMask & ~tfMask) | supMode);
         putRegister(14, getRegister(15, regCurrent) - 4, regCurrent);
         putRegister(15, 8, regCurrent);
         break;
@@ -2056,8 +3955,9 @@ void mySystem(uint opCode) {
  * @brief This is the breakpoint instruction.
  */
 void breakpoint() {
-  spsr[abtMode] = cpsr;
-  cpsr = (cpsr & ~modeMask & ~tfMask) | abtMode;
+  materialiseFlags();
+  machine->spsr[abtMode] = machine->cpsr;
+  setCPSR((machine->cpsr & ~modeMask & ~tfMask) | abtMode);
   putRegister(14, getRegister(15, regCurrent) - 4, regCurrent);
   putRegister(15, 12, regCurrent);
 }
@@ -2066,8 +3966,9 @@ void breakpoint() {
  * @brief
  */
 void undefined() {
-  spsr[undefMode] = cpsr;
-  cpsr = (cpsr & ~modeMask & ~tfMask) | undefMode;
+  materialiseFlags();
+  machine->spsr[undefMode] = machine->cpsr;
+  setCPSR((machine->cpsr & ~modeMask & ~tfMask) | undefMode);
   putRegister(14, getRegister(15, regCurrent) - 4, regCurrent);
   putRegister(15, 4, regCurrent);
 }
@@ -2081,36 +3982,93 @@ void undefined() {
  * @param carry
  */
 void setFlags(int operation, int a, int b, int rd, int carry) {
-  setNZ(rd);
-  setCF(a, rd, carry);
-  switch (operation) {
-    case 1:
-      setVF_ADD(a, b, rd);
-      break;
-    case 2:
-      setVF_SUB(a, b, rd);
-      break;
-    default:
-      fprintf(stderr, "Flag setting error\n");
-      break;
-  }
+  machine->flagResult = rd;
+  machine->flagNZPending = true;
+  machine->flagCV = operation;
+  machine->flagA = a;
+  machine->flagB = b;
+  machine->flagCarry = carry;
 }
 
 /**
- * @brief
+ * @brief Defers N and Z from a result; C and V are left as they stand.
  * @param value
  */
 void setNZ(uint value) {
-  if (value == 0) {
-    cpsr = cpsr | zfMask;
-  } else {
-    cpsr = cpsr & ~zfMask;
+  if (machine->flagCV != flagNone) {
+    materialiseFlags();  // C and V are still to be derived from flagResult
+  }
+  machine->flagResult = value;
+  machine->flagNZPending = true;
+}
+
+/**
+ * @brief Bring the NZCV bits of cpsr up to date with any deferred flag
+ * setting. Anything reading the flags directly from cpsr must call this.
+ */
+void materialiseFlags() {
+  if (machine->flagNZPending) {
+    machine->cpsr = machine->cpsr & ~(zfMask | nfMask);
+    if (machine->flagResult == 0) {
+      machine->cpsr = machine->cpsr | zfMask;
+    }
+    if ((machine->flagResult & bit31) != 0) {
+      machine->cpsr = machine->cpsr | nfMask;
+    }
+    machine->flagNZPending = false;
+  }
+
+  if (machine->flagCV != flagNone) {
+    setCF(machine->flagA, machine->flagResult, machine->flagCarry);
+    switch (machine->flagCV) {
+      case flagAdd:
+        setVF_ADD(machine->flagA, machine->flagB, machine->flagResult);
+        break;
+      case flagSub:
+        setVF_SUB(machine->flagA, machine->flagB, machine->flagResult);
+        break;
+      default:
+        fprintf(stderr, "Flag setting error\n");
+        break;
+    }
+    machine->flagCV = flagNone;
+  }
+}
+
+/**
+ * @brief The current C flag, without materialising the others.
+ * @return bool
+ */
+bool carryFlag() {
+  if (machine->flagCV != flagNone) {
+    return !((machine->flagResult > machine->flagA) ||
+             ((machine->flagResult == machine->flagA) &&
+              (machine->flagCarry == 0)));
+  }
+  return (machine->cpsr & cfMask) != 0;
+}
+
+/**
+ * @brief Set the C flag directly (e.g. from the shifter), leaving V alone.
+ * @param carry
+ */
+void setCarry(bool carry) {
+  if (machine->flagCV != flagNone) {  // V still belongs to an earlier operation
+    switch (machine->flagCV) {
+      case flagAdd:
+        setVF_ADD(machine->flagA, machine->flagB, machine->flagResult);
+        break;
+      case flagSub:
+        setVF_SUB(machine->flagA, machine->flagB, machine->flagResult);
+        break;
+    }
+    machine->flagCV = flagNone;
   }
 
-  if ((value & bit31) != 0) {
-    cpsr = cpsr | nfMask;
+  if (carry) {
+    machine->cpsr = machine->cpsr | cfMask;
   } else {
-    cpsr = cpsr & ~nfMask;
+    machine->cpsr = machine->cpsr & ~cfMask;
   }
 }
 
@@ -2122,9 +4080,9 @@ void setNZ(uint value) {
  */
 void setCF(uint a, uint rd, int carry) {
   if ((rd > a) || ((rd == a) && (carry == 0)))
-    cpsr = cpsr & ~cfMask;
+    machine->cpsr = machine->cpsr & ~cfMask;
   else
-    cpsr = cpsr | cfMask;
+    machine->cpsr = machine->cpsr | cfMask;
 }
 
 /**
@@ -2134,9 +4092,9 @@ void setCF(uint a, uint rd, int carry) {
  * @param rd
  */
 void setVF_ADD(int a, int b, int rd) {
-  cpsr = cpsr & ~vfMask;  // Clear VF
+  machine->cpsr = machine->cpsr & ~vfMask;  // Clear VF
   if (((~(a ^ b) & (a ^ rd)) & bit31) != 0) {
-    cpsr = cpsr | vfMask;
+    machine->cpsr = machine->cpsr | vfMask;
   }
 }
 
@@ -2147,9 +4105,9 @@ void setVF_ADD(int a, int b, int rd) {
  * @param rd
  */
 void setVF_SUB(int a, int b, int rd) {
-  cpsr = cpsr & ~vfMask;  // Clear VF
+  machine->cpsr = machine->cpsr & ~vfMask;  // Clear VF
   if ((((a ^ b) & (a ^ rd)) & bit31) != 0) {
-    cpsr = cpsr | vfMask;
+    machine->cpsr = machine->cpsr | vfMask;
   }
 }
 
@@ -2160,82 +4118,42 @@ void setVF_SUB(int a, int b, int rd) {
  * @return false
  */
 bool checkCC(int condition) {
-  switch (condition & 0XF) {
-    case 0X0:
-      return zf(cpsr);
-    case 0X1:
-      return not zf(cpsr);
-    case 0X2:
-      return cf(cpsr);
-    case 0X3:
-      return not cf(cpsr);
-    case 0X4:
-      return nf(cpsr);
-    case 0X5:
-      return not nf(cpsr);
-    case 0X6:
-      return vf(cpsr);
-    case 0X7:
-      return not vf(cpsr);
-    case 0X8:
-      return cf(cpsr) and not zf(cpsr);
-    case 0X9:
-      return (not cf(cpsr)) or zf(cpsr);
-    case 0XA:
-      return not(nf(cpsr) xor vf(cpsr));
-    case 0XB:
-      return nf(cpsr) xor vf(cpsr);
-    case 0XC:
-      return (not zf(cpsr)) and (not(nf(cpsr) xor vf(cpsr)));
-    case 0XD:
-      return zf(cpsr) or (nf(cpsr) xor vf(cpsr));
-    case 0XE:
-      return true;
-    case 0XF:
-      return false;
-    default:
-      return true;
+  if (machine->flagNZPending && ((condition & 0XE) == 0X0)) {  // EQ/NE
+    return ((machine->flagResult == 0) != ((condition & 1) != 0));
+  } else if (machine->flagNZPending && ((condition & 0XE) == 0X4)) {  // MI/PL
+    return (((machine->flagResult & bit31) != 0) != ((condition & 1) != 0));
   }
-}
 
-/**
- * @brief
- * @param cpsr
- * @return true
- * @return false
- */
-constexpr const bool zf(const int cpsr) {
-  return (zfMask & cpsr) != 0;
+  materialiseFlags();
+  return ((conditionTable[condition & 0XF] >> (machine->cpsr >> 28)) & 1) != 0;
 }
 
 /**
- * @brief
- * @param cpsr
+ * @brief checks CC against the flags, deferred or not, without bringing cpsr
+ * up to date.
+ * @param condition
  * @return true
  * @return false
  */
-constexpr const bool cf(const int cpsr) {
-  return (cfMask & cpsr) != 0;
-}
+bool checkPendingCC(int condition) {
+  if (!machine->flagNZPending) {
+    return checkCC(condition);
+  }
 
-/**
- * @brief
- * @param cpsr
- * @return true
- * @return false
- */
-constexpr const bool nf(const int cpsr) {
-  return (nfMask & cpsr) != 0;
-}
+  const uint result = machine->flagResult;
+  uint nzcv = (machine->cpsr >> 28) & 3; /* C and V, unless deferred */
 
-/**
- * @brief
- * @param cpsr
- * @return true
- * @return false
- */
-constexpr const bool vf(const int cpsr) {
-  return (vfMask & cpsr) != 0;
+  if (machine->flagCV != flagNone) {
+    const uint a = machine->flagA;
+    const uint b = machine->flagB;
+    const uint overflow = (machine->flagCV == flagAdd)
+                              ? ~(a ^ b) & (a ^ result)
+                              : (a ^ b) & (a ^ result);
+
+    nzcv = (carryFlag() ? 2 : 0) | (overflow >> 31);
+  }
+  nzcv |= ((result >> 28) & 8) | ((result == 0) ? 4 : 0);
+  return ((conditionTable[condition & 0XF] >> nzcv) & 1) != 0;
 }
 
 /**
@@ -2245,96 +4163,24 @@ constexpr const bool vf(const int cpsr) {
  * @return int
  */
 int getRegister(int regNum, int forceMode) {
-  int mode, value;
-
-  switch (forceMode) {
-    case regCurrent:
-      mode = cpsr & modeMask;
-      break;
-    case regUser:
-      mode = userMode;
-      break;
-    case regSvc:
-      mode = supMode;
-      break;
-    case regFiq:
-      mode = fiqMode;
-      break;
-    case regIrq:
-      mode = irqMode;
-      break;
-    case regAbt:
-      mode = abtMode;
-      break;
-    case regUndef:
-      mode = undefMode;
-      break;
-  }
-
-  if (regNum == 16) {
-    value = cpsr;  // Trap for status registers
-  } else if (regNum == 17) {
-    if ((mode == userMode) || (mode == systemMode)) {
-      value = cpsr;
-    } else {
-      value = spsr[mode];
-    }
-  } else if (regNum != 15) {
-    switch (mode) {
-      case userMode:
-      case systemMode:
-        value = r[regNum];
-        break;
-
-      case fiqMode:
-        if (regNum < 8) {
-          value = r[regNum];
-
-        } else {
-          value = fiqR[regNum - 8];
-        }
-        break;
-
-      case irqMode:
-        if (regNum < 13) {
-          value = r[regNum];
-        } else {
-          value = irqR[regNum - 13];
-        }
-        break;
-
-      case supMode:
-        if (regNum < 13) {
-          value = r[regNum];
-
-        } else {
-          value = supR[regNum - 13];
-        }
-        break;
-
-      case abtMode:
-        if (regNum < 13) {
-          value = r[regNum];
-
-        } else {
-          value = abtR[regNum - 13];
-        }
-        break;
-
-      case undefMode:
-        if (regNum < 13) {
-          value = r[regNum];
-
-        } else {
-          value = underR[regNum - 13];
-        }
-        break;
+  if (regNum < 15) {
+    if (forceMode == regCurrent) {
+      return machine->r[regNum];  // The common case
     }
-  } else {
-    value = r[15] + instructionLength(cpsr, tfMask);
+    return *registerFor(regNum, forcedMode(forceMode));
+  } else if (regNum == 15) {
+    return machine->r[15] + instructionLength(machine->cpsr, tfMask);
+  } else if (regNum == 16) {
+    materialiseFlags();
+    return machine->cpsr;  // Trap for status registers
   }
 
-  return value;
+  const uint mode = forcedMode(forceMode);
+  if ((mode == userMode) || (mode == systemMode)) {
+    materialiseFlags();
+    return machine->cpsr;
+  }
+  return machine->spsr[mode];
 }
 
 /**
@@ -2347,7 +4193,7 @@ int getRegisterMonitor(int regNum, int forceMode) {
   if (regNum != 15) {
     return getRegister(regNum, forceMode);
   } else {
-    return r[15];  // PC access
+    return machine->r[15];  // PC access
   }
 }
 
@@ -2358,90 +4204,157 @@ int getRegisterMonitor(int regNum, int forceMode) {
  * @param forceMode
  */
 void putRegister(int regNum, int value, int forceMode) {
-  int mode;
+  if (regNum < 15) {
+    if (forceMode == regCurrent) {
+      machine->r[regNum] = value;  // The common case
+    } else {
+      *registerFor(regNum, forcedMode(forceMode)) = value;
+    }
+  } else if (regNum == 15) {
+    /* Lose bottom bit, but NOT mode specific! */
+    machine->r[15] = value & 0XFFFFFFFE;
+  } else if (regNum == 16) {
+    setCPSR(value); /* Trap for status registers */
+  } else {
+    const uint mode = forcedMode(forceMode);
+    if ((mode == userMode) || (mode == systemMode))
+      setCPSR(value);
+    else
+      machine->spsr[mode] = value;
+  }
+}
 
+/**
+ * @brief Translates a "forceMode" register access qualifier into a mode.
+ * @param forceMode
+ * @return uint
+ */
+uint forcedMode(int forceMode) {
   switch (forceMode) {
-    case regCurrent:
-      mode = cpsr & modeMask;
-      break;
     case regUser:
-      mode = userMode;
-      break;
+      return userMode;
     case regSvc:
-      mode = supMode;
-      break;
+      return supMode;
     case regFiq:
-      mode = fiqMode;
-      break;
+      return fiqMode;
     case regIrq:
-      mode = irqMode;
-      break;
+      return irqMode;
     case regAbt:
-      mode = abtMode;
-      break;
+      return abtMode;
     case regUndef:
-      mode = undefMode;
-      break;
+      return undefMode;
+    default:
+      return machine->cpsr & modeMask;
   }
+}
 
-  if (regNum == 16)
-    cpsr = value; /* Trap for status registers */
-  else if (regNum == 17) {
-    if ((mode == userMode) || (mode == systemMode))
-      cpsr = value;
-    else
-      spsr[mode] = value;
-  } else if (regNum != 15) {
-    switch (mode) {
-      case userMode:
-      case systemMode:
-        r[regNum] = value;
-        break;
+/**
+ * @brief Which set of banked registers a mode uses; user and system modes
+ * (and anything unrecognised) share one.
+ * @param mode
+ * @return uint One of the regXXX constants.
+ */
+constexpr uint registerBank(const uint mode) {
+  switch (mode) {
+    case fiqMode:
+      return regFiq;
+    case irqMode:
+      return regIrq;
+    case supMode:
+      return regSvc;
+    case abtMode:
+      return regAbt;
+    case undefMode:
+      return regUndef;
+    default:
+      return regUser;
+  }
+}
 
-      case fiqMode:
-        if (regNum < 8)
-          r[regNum] = value;
-        else
-          fiqR[regNum - 8] = value;
-        break;
+/**
+ * @brief Where R8-R14 of a mode are kept while that mode is not current.
+ * R8-R12 are shared by all modes except FIQ.
+ * @param regNum 8 to 14
+ * @param mode
+ * @return int*
+ */
+int* bankedRegister(int regNum, uint mode) {
+  if (registerBank(mode) == regFiq) {
+    return &machine->fiqR[regNum - 8];
+  } else if (regNum < 13) {
+    return &machine->usrR[regNum - 8];
+  }
 
-      case irqMode:
-        if (regNum < 13)
-          r[regNum] = value;
-        else
-          irqR[regNum - 13] = value;
-        break;
+  switch (registerBank(mode)) {
+    case regIrq:
+      return &machine->irqR[regNum - 13];
+    case regSvc:
+      return &machine->supR[regNum - 13];
+    case regAbt:
+      return &machine->abtR[regNum - 13];
+    case regUndef:
+      return &machine->underR[regNum - 13];
+    default:
+      return &machine->usrR[regNum - 8];
+  }
+}
 
-      case supMode:
-        if (regNum < 13)
-          r[regNum] = value;
-        else
-          supR[regNum - 13] = value;
-        break;
+/**
+ * @brief Locates R0-R14 of any mode: in "r" if the current mode sees the same
+ * register, otherwise in its bank.
+ * @param regNum
+ * @param mode
+ * @return int*
+ */
+int* registerFor(int regNum, uint mode) {
+  const uint current = registerBank(machine->cpsr & modeMask);
+  const uint target = registerBank(mode);
 
-      case abtMode:
-        if (regNum < 13)
-          r[regNum] = value;
-        else
-          abtR[regNum - 13] = value;
-        break;
+  if ((regNum < 8) || (target == current) ||
+      ((regNum < 13) && (target != regFiq) && (current != regFiq))) {
+    return &machine->r[regNum];
+  }
+  return bankedRegister(regNum, mode);
+}
 
-      case undefMode:
-        if (regNum < 13)
-          r[regNum] = value;
-        else
-          underR[regNum - 13] = value;
-        break;
-    }
-  } else
-    r[15] = value & 0XFFFFFFFE; /* Lose bottom bit, but NOT mode specific! */
+/**
+ * @brief Writes the whole CPSR, exchanging the visible registers if the mode
+ * changes. All mode changes must come through here; callers deriving the
+ * value from cpsr must materialise the flags first.
+ * @param value
+ */
+void setCPSR(uint value) {
+  if (((value ^ machine->cpsr) & modeMask) != 0) {
+    switchBank(machine->cpsr & modeMask, value & modeMask);
+  }
+  machine->cpsr = value;
+  machine->flagNZPending = false;  // Any deferred flags are superseded
+  machine->flagCV = flagNone;
+}
+
+/**
+ * @brief Banks out R8-R14 of the old mode and brings in those of the new.
+ * @param oldMode
+ * @param newMode
+ */
+void switchBank(uint oldMode, uint newMode) {
+  if (registerBank(oldMode) == registerBank(newMode)) {
+    return;
+  }
+
+  for (int i = 8; i < 15; i++) {
+    *bankedRegister(i, oldMode) = machine->r[i];
+  }
+  for (int i = 8; i < 15; i++) {
+    machine->r[i] = *bankedRegister(i, newMode);
+  }
 }
 
 /**
  * @brief Return the length, in bytes, of the currently expected instruction.
  * @return int 4 for ARM, 2 for Thumb.
  */
-constexpr const int instructionLength(const int cpsr, const int tfMask) {
+constexpr int instructionLength(const int cpsr, const int tfMask) {
   if ((cpsr & tfMask) == 0) {
     return 4;
   }
@@ -2450,27 +4363,50 @@ constexpr const int instructionLength(const int cpsr, const int tfMask) {
 }
 
 /**
- * @brief
- * @return uint
+ * @brief Fetches the next instruction, decoding it unless the predecode cache
+ * already holds it.
+ * @return const decodedInstruction*
  */
-uint fetch() {
-  uint opCode = readMemory(
-      (getRegister(15, regCurrent) - instructionLength(cpsr, tfMask)),
-      instructionLength(cpsr, tfMask), false, false, memInstruction);
-
-  for (int i = 0; i < 32; i++) {
-    if (pastOpcAddr[i] ==
-        getRegister(15, regCurrent) - instructionLength(cpsr, tfMask)) {
-      pastCount++;
-      i = 32;  // bodged escape from loop
+const decodedInstruction* fetch() {
+  const uint address =
+      getRegister(15, regCurrent) - instructionLength(machine->cpsr, tfMask);
+  const uchar state =
+      ((machine->cpsr & tfMask) != 0) ? decodedThumb : decodedARM;
+  decodedInstruction* decoded =
+      &machine->decodeCache[(address >> 1) & (decodeCacheSize - 1)];
+
+  if ((decoded->state != state) || (decoded->address != address)) {
+    uint opCode =
+        readMemory(address, instructionLength(machine->cpsr, tfMask), false,
+                             false, memInstruction);
+
+    if (address >= memSize) {
+      decoded = &machine->uncached;
     }
+    decode(opCode, decoded);
+    decoded->address = address;
+    decoded->state = (address < memSize) ? state : decodedEmpty;
   }
 
-  pastOpcAddr[pastOpcPtr++] =
-      getRegister(15, regCurrent) - instructionLength(cpsr, tfMask);
-  pastOpcPtr = pastOpcPtr % pastSize;
+  noteFetchAddress(address);
 
-  return opCode;
+  return decoded;
+}
+
+/**
+ * @brief Records a fetch in the op. code address history: a hit is a
+ * re-execution of an address still in its slot.
+ * @param address
+ */
+void noteFetchAddress(uint address) {
+  if (machine->pastEnabled) {
+    uint* entry = &machine->pastOpcAddr[(address >> 1) & (pastSize - 1)];
+
+    if (*entry == address) {
+      machine->pastCount++;
+    }
+    *entry = address;
+  }
 }
 
 /**
@@ -2498,67 +4434,55 @@ void endianSwap(const uint start, const uint end) {
  * @param address
  * @param size
  * @param sign
- * @param T
  * @param source indicates type of read {memSystem, memInstruction, memData}
  * @return int
  */
-int readMemory(uint address, int size, bool sign, bool T, int source) {
-  int data, alignment;
+int readMemory(uint address, int size, bool sign, bool, int source) {
+  int data;
 
   if (address < memSize) {
-    alignment = address & 0X00000003;
-    data = getmem32(address >> 2);
-
-    switch (address & 0X00000003) /* Apply rotation */
-    {
-      case 0:
-        break; /* RR  0 */
-      case 1:
-        data = (data << 24) | ((data >> 8) & 0X00FFFFFF);
-        break; /* RR  8 */
-      case 2:
-        data = (data << 16) | ((data >> 16) & 0X0000FFFF);
-        break; /* RR 16 */
-      case 3:
-        data = (data << 8) | ((data >> 24) & 0X000000FF);
-        break; /* RR 24 */
-    }
-
     switch (size) {
       case 0:
         data = 0;
         break; /* A bit silly really */
 
       case 1: /* byte access */
-        if ((sign) && ((data & 0X00000080) != 0))
-          data = data | 0XFFFFFF00;
-        else
-          data = data & 0X000000FF;
+        data = sign ? (int)(signed char)machine->memory[address]
+                    : machine->memory[address];
         break;
 
       case 2: /* half-word access */
+        if ((address & 1) == 0)
+          data = getmem16(address >> 1);
+        else
+          data = rotatedWord(address) & 0X0000FFFF;
+
         if ((sign) && ((data & 0X00008000) != 0))
           data = data | 0XFFFF0000;
-        else
-          data = data & 0X0000FFFF;
         break;
 
-      case 4:
-        break; /* word access */
+      case 4: /* word access */
+        if ((address & 3) == 0)
+          data = getmem32(address >> 2);
+        else
+          data = rotatedWord(address);
+        break;
 
       default:
+        data = 0;
         fprintf(stderr, "Illegally sized memory read\n");
     }
 
     /* check watchpoints enabled */
-    if ((runFlags & 0x20) && (source == memData)) {
+    if ((machine->runFlags & 0x20) && (source == memData) &&
+        (watchedAt(address) != 0)) {
       if (checkWatchpoints(address, data, size, 1)) {
-        status = CLIENT_STATE_WATCHPOINT;
+        machine->status = CLIENT_STATE_WATCHPOINT;
       }
     }
   } else {
     data = 0X12345678;
-    printOut = false;
+    machine->printOut = false;
   }
 
   return data;
@@ -2569,17 +4493,23 @@ int readMemory(uint address, int size, bool sign, bool T, int source) {
  * @param address
  * @param data
  * @param size
- * @param T
  * @param source
  */
-void writeMemory(uint address, int data, int size, bool T, int source) {
-  uint mask;
+void writeMemory(uint address, int data, int size, bool, int source) {
+  if ((machine->trace != NULL) && (source == memData)) {
+    traceRecord* record = nextTraceRecord();
+
+    record->kind = traceWrite;
+    record->size = size;
+    record->address = address;
+    record->value = data;
+  }
 
   // Deal with Tube output
-  if ((address == tubeAddress) && (tubeAddress != 0)) {
+  if ((address == machine->tubeAddress) && (machine->tubeAddress != 0)) {
     uchar c = data & 0XFF;
 
-    if (!printOut) {
+    if (!machine->printOut) {
       if ((c == 0X0A) || (c == 0X0D)) {
         fprintf(stderr, "\n");
       } else if ((c < 0X20) || (c >= 0X7F)) {
@@ -2596,23 +4526,19 @@ void writeMemory(uint address, int data, int size, bool T, int source) {
       }
     }
   } else {
-    if ((address >> 2) < memSize) {
+    if (address < memSize) {
       switch (size) {
         case 0:
           break; /* A bit silly really */
 
         case 1: /* byte access */
-          mask = 0X000000FF << (8 * (address & 0X00000003));
-          data = data << (8 * (address & 0X00000003));
-          setmem32(address >> 2,
-                   (getmem32(address >> 2) & ~mask) | (data & mask));
+          preservePages(address, 1);
+          invalidateDecodeCache(address, 1);
+          machine->memory[address] = data & 0XFF;
           break;
 
         case 2: /* half-word acccess */
-          mask = 0X0000FFFF << (8 * (address & 0X00000002));
-          data = data << (8 * (address & 0X00000002));
-          setmem32(address >> 2,
-                   (getmem32(address >> 2) & ~mask) | (data & mask));
+          setmem16(address >> 1, data);
           break;
 
         case 4: /* word access */
@@ -2624,14 +4550,14 @@ void writeMemory(uint address, int data, int size, bool T, int source) {
       }
     } else {
       // fprintf(stderr, "Writing %08X  data = %08X\n", address, data);
-      printOut = false;
+      machine->printOut = false;
     }
 
-    if ((runFlags & 0x20) &&
-        (source == memData)) /* check watchpoints enabled */
+    if ((machine->runFlags & 0x20) && (source == memData) &&
+        (watchedAt(address) != 0)) /* check watchpoints enabled */
     {
       if (checkWatchpoints(address, data, size, 0)) {
-        status = CLIENT_STATE_WATCHPOINT;
+        machine->status = CLIENT_STATE_WATCHPOINT;
       }
     }
   }
@@ -2647,23 +4573,25 @@ void writeMemory(uint address, int data, int size, bool T, int source) {
  */
 int checkWatchpoints(uint address, int data, int size, int direction) {
   bool may_break = false;
+  uint candidates = watchedAt(address);
 
-  for (int i = 0; (i < NO_OF_WATCHPOINTS) && !may_break; i++) {
-    may_break = ((emulWPFlag[0] & emulWPFlag[1] & (1 << i)) != 0);
-    /* Watchpoint is active */
+  for (int i = 0; (candidates != 0) && !may_break; i++, candidates >>= 1) {
+    may_break = ((candidates & 1) != 0);
+    /* Watchpoint is active here */
 
-    may_break &= ((watchpoints[i].size & size) != 0); /* Size is allowed? */
+    /* Size is allowed? */
+    may_break &= ((machine->watchpoints[i].size & size) != 0);
 
     if (may_break) {
       if (direction == 0) {
-        may_break = (watchpoints[i].cond & 0x10) != 0;
+        may_break = (machine->watchpoints[i].cond & 0x10) != 0;
       } else {
-        may_break = (watchpoints[i].cond & 0x20) != 0;
+        may_break = (machine->watchpoints[i].cond & 0x20) != 0;
       }
     }
 
     if (may_break) /* Try address comparison */
-      switch (watchpoints[i].cond & 0x0C) {
+      switch (machine->watchpoints[i].cond & 0x0C) {
         case 0x00:
           may_break = false;
           break;
@@ -2671,19 +4599,20 @@ int checkWatchpoints(uint address, int data, int size, int direction) {
           may_break = false;
           break;
         case 0x08: /* Case of between address A and address B */
-          if ((address < watchpoints[i].addrA) ||
-              (address > watchpoints[i].addrB))
+          if ((address < (uint)machine->watchpoints[i].addrA) ||
+              (address > (uint)machine->watchpoints[i].addrB))
             may_break = false;
           break;
 
         case 0x0C: /* Case of mask */
-          if ((address & watchpoints[i].addrB) != watchpoints[i].addrA)
+          if ((address & machine->watchpoints[i].addrB) !=
+              (uint)machine->watchpoints[i].addrA)
             may_break = false;
           break;
       }
 
     if (may_break) /* Try data comparison */
-      switch (watchpoints[i].cond & 0x03) {
+      switch (machine->watchpoints[i].cond & 0x03) {
         case 0x00:
           may_break = false;
           break;
@@ -2691,13 +4620,14 @@ int checkWatchpoints(uint address, int data, int size, int direction) {
           may_break = false;
           break;
         case 0x02: /* Case of between data A and data B */
-          if ((data < watchpoints[i].dataA[0]) ||
-              (data > watchpoints[i].dataB[0]))
+          if ((data < machine->watchpoints[i].dataA[0]) ||
+              (data > machine->watchpoints[i].dataB[0]))
             may_break = false;
           break;
 
         case 0x03: /* Case of mask */
-          if ((data & watchpoints[i].dataB[0]) != watchpoints[i].dataA[0])
+          if ((data & machine->watchpoints[i].dataB[0]) !=
+              machine->watchpoints[i].dataA[0])
             may_break = false;
           break;
       }
@@ -2706,6 +4636,61 @@ int checkWatchpoints(uint address, int data, int size, int direction) {
   return may_break;
 }
 
+/**
+ * @brief Which watchpoints could match an access at this address.
+ * @param address
+ * @return uint A bit per watchpoint
+ */
+uint watchedAt(uint address) {
+  if (address < memSize) {
+    return machine->watchedPages[address >> watchPageShift];
+  }
+  return machine->activeWatchpoints;
+}
+
+/**
+ * @brief Rebuilds the map of pages each watchpoint's address condition can
+ * match. Must be called whenever the watchpoints or their flags change.
+ */
+void indexWatchpoints() {
+  machine->activeWatchpoints = machine->emulWPFlag[0] & machine->emulWPFlag[1];
+  for (uint& page : machine->watchedPages) {
+    page = 0;
+  }
+
+  for (int i = 0; i < NO_OF_WATCHPOINTS; i++) {
+    if ((machine->activeWatchpoints & (1 << i)) == 0) {
+      continue;
+    }
+
+    const uint addrA = machine->watchpoints[i].addrA;
+    const uint addrB = machine->watchpoints[i].addrB;
+    const uint pageMask = ~((1 << watchPageShift) - 1);
+
+    switch (machine->watchpoints[i].cond & 0x0C) {
+      case 0x08: /* Case of between address A and address B */
+        for (uint page = addrA >> watchPageShift;
+             (page <= (addrB >> watchPageShift)) &&
+             (page < (memSize >> watchPageShift));
+             page++) {
+          machine->watchedPages[page] |= 1 << i;
+        }
+        break;
+
+      case 0x0C: /* Case of mask; the page offset can be anything */
+        if ((addrA & ~addrB) != 0) {
+          break; /* Never matches */
+        }
+        for (uint page = 0; page < (memSize >> watchPageShift); page++) {
+          if ((((page << watchPageShift) ^ addrA) & addrB & pageMask) == 0) {
+            machine->watchedPages[page] |= 1 << i;
+          }
+        }
+        break;
+    }
+  }
+}
+
 /**
  * @brief Get the Number object
  * @param ptr
@@ -2838,580 +4823,444 @@ int ror(uint value, int distance, int* cf) {
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief LSL (1), LSR (1) and ASR (1).
+ * @tparam type Op. code bits 12:11 - 0 LSL, 1 LSR, 2 ASR
+ * @param decoded
  */
-void data0(uint opCode) {
-  uint op2, result;
-  int cf;
-
-  uint rn =
-      getRegister(((opCode >> 3) & 7), regCurrent);  // Called Rm in shifts
-  uint shift = ((opCode >> 6) & 0X0000001F);         // Extracted speculatively
-
-  // Shifts
-  if ((opCode & 0X1800) != 0X1800) {
-    cf = ((cpsr & cfMask) != 0);  // default
-    switch (opCode & 0X1800) {
-      case 0X0000:
-        result = lsl(rn, shift, &cf);
-        break;      // LSL (1)
-      case 0X0800:  // LSR (1)
-        if (shift == 0) {
-          shift = 32;
-        }
-
-        result = lsr(rn, shift, &cf);
-        break;
-      case 0X1000:  // ASR (1)
-        if (shift == 0) {
-          shift = 32;
-        }
-        result = asr(rn, shift, &cf);
-        break;
-      default:
-        fprintf(stderr, "This compiler is broken\n");
-        break;
-    }
+template <uint type>
+void thumbShiftImmediate(const decodedInstruction* decoded) {
+  const uint opCode = decoded->opCode;
+  const uint rm = getRegister((opCode >> 3) & 7, regCurrent);
+  uint shift = (opCode >> 6) & 0X1F;
+  int cf = carryFlag();  // default
+  uint result;
+
+  if ((type != 0) && (shift == 0)) {
+    shift = 32;
+  }
 
-    if (cf) {
-      cpsr = cpsr | cfMask;
-    } else {
-      cpsr = cpsr & ~cfMask;
-    }
-    setNZ(result);
-    putRegister((opCode & 7), result, regCurrent);
+  if (type == 0) {
+    result = lsl(rm, shift, &cf);
+  } else if (type == 1) {
+    result = lsr(rm, shift, &cf);
   } else {
-    // ADD(3)/SUB(3)
-    if ((opCode & 0X0400) == 0) {
-      op2 = getRegister((opCode >> 6) & 7, regCurrent);
-    }
-    // ADD(1)/SUB(1)
-    else {
-      op2 = (opCode >> 6) & 7;
-    };
-
-    if ((opCode & 0X0200) == 0) {
-      result = rn + op2;
-      setFlags(flagAdd, rn, op2, result, 0);
-    } else {
-      result = rn - op2;
-      setFlags(flagSub, rn, op2, result, 1);
-    }
+    result = asr(rm, shift, &cf);
+  }
+
+  setCarry(cf);
+  setNZ(result);
+  putRegister(opCode & 7, result, regCurrent);
+}
 
-    putRegister(opCode & 7, result, regCurrent);
+/**
+ * @brief ADD (1)/(3) and SUB (1)/(3).
+ * @tparam immediate The second operand is a 3-bit immediate, not a register
+ * @tparam subtract
+ * @param decoded
+ */
+template <bool immediate, bool subtract>
+void thumbAddSub(const decodedInstruction* decoded) {
+  const uint opCode = decoded->opCode;
+  const uint rn = getRegister((opCode >> 3) & 7, regCurrent);
+  const uint op2 = immediate ? ((opCode >> 6) & 7)
+                             : getRegister((opCode >> 6) & 7, regCurrent);
+  uint result;
+
+  if (subtract) {
+    result = rn - op2;
+    setFlags(flagSub, rn, op2, result, 1);
+  } else {
+    result = rn + op2;
+    setFlags(flagAdd, rn, op2, result, 0);
   }
+
+  putRegister(opCode & 7, result, regCurrent);
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief MOV (1), CMP (1), ADD (2) and SUB (2): an 8-bit immediate.
+ * @tparam operation Op. code bits 12:11
+ * @param decoded
  */
-void data1(uint opCode) {
-  int rd, imm;
+template <uint operation>
+void thumbImmediate(const decodedInstruction* decoded) {
+  const uint opCode = decoded->opCode;
+  const int rd = (opCode >> 8) & 7;
+  const int imm = opCode & 0X00FF;
+  const int value = getRegister(rd, regCurrent);
   int result;
 
-  rd = (opCode >> 8) & 7;
-  imm = opCode & 0X00FF;
-
-  switch (opCode & 0X1800) {
-    case 0X0000: /* MOV (1) */
-      result = imm;
-      setNZ(result);
-      putRegister(rd, result, regCurrent);
+  switch (operation) {
+    case 0: /* MOV (1) */
+      setNZ(imm);
+      putRegister(rd, imm, regCurrent);
       break;
 
-    case 0X0800: /* CMP (1) */
-      result = (getRegister(rd, regCurrent) - imm);
-      setFlags(flagSub, getRegister(rd, regCurrent), imm, result, 1);
+    case 1: /* CMP (1) */
+      setFlags(flagSub, value, imm, value - imm, 1);
       break;
 
-    case 0X1000: /* ADD (2) */
-      result = (getRegister(rd, regCurrent) + imm);
-      setFlags(flagAdd, getRegister(rd, regCurrent), imm, result, 0);
+    case 2: /* ADD (2) */
+      result = value + imm;
+      setFlags(flagAdd, value, imm, result, 0);
       putRegister(rd, result, regCurrent);
       break;
 
-    case 0X1800: /* SUB (2) */
-      result = (getRegister(rd, regCurrent) - imm);
-      setFlags(flagSub, getRegister(rd, regCurrent), imm, result, 1);
+    case 3: /* SUB (2) */
+      result = value - imm;
+      setFlags(flagSub, value, imm, result, 1);
       putRegister(rd, result, regCurrent);
       break;
   }
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief The register to register data processing operations.
+ * @tparam operation Op. code bits 9:6
+ * @param decoded
  */
-void dataTransfer(uint opCode) {
-  uint rd, rm;
-  int cf;
-
-  uint address;
-
-  signed int result;
-
-  if ((opCode & 0X1000) == 0) /* NOT load/store */
-  {
-    if ((opCode & 0X0800) == 0) /* NOT load literal pool */
-    {
-      if ((opCode & 0X0400) == 0) /* Data processing */
-      {
-        rd = getRegister((opCode & 7), regCurrent);
-        rm = getRegister(((opCode >> 3) & 7), regCurrent);
-
-        switch (opCode & 0X03C0) /* data processing opcode */
-        {
-          case 0X0000:  // AND
-            result = rd & rm;
-            putRegister(opCode & 7, result, regCurrent);
-            setNZ(result);
-            break;
-
-          case 0X0040: /* EOR */
-            result = rd ^ rm;
-            putRegister(opCode & 7, result, regCurrent);
-            setNZ(result);
-            break;
-
-          case 0X0080:                   /* LSL (2) */
-            cf = ((cpsr & cfMask) != 0); /* default */
-            result = lsl(rd, rm & 0X000000FF, &cf);
-            if (cf)
-              cpsr = cpsr | cfMask;
-            else
-              cpsr = cpsr & ~cfMask;
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-
-          case 0X00C0:                    // LSR (2)
-            cf = ((cpsr & cfMask) != 0);  // default
-            result = lsr(rd, rm & 0X000000FF, &cf);
-            if (cf) {
-              cpsr = cpsr | cfMask;
-            } else {
-              cpsr = cpsr & ~cfMask;
-            }
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-
-          case 0X0100:                    // ASR (2)
-            cf = ((cpsr & cfMask) != 0);  // default
-            result = asr(rd, rm & 0X000000FF, &cf);
-            if (cf) {
-              cpsr = cpsr | cfMask;
-            } else {
-              cpsr = cpsr & ~cfMask;
-            }
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-
-          case 0X0140:  // ADC
-            result = rd + rm;
-            if ((cpsr & cfMask) != 0) {
-              result = result + 1;  // Add CF
-            }
-            setFlags(flagAdd, rd, rm, result, cpsr & cfMask);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-
-          case 0X0180:  // SBC
-            result = rd - rm - 1;
-            if ((cpsr & cfMask) != 0) {
-              result = result + 1;
-            }
-            setFlags(flagSub, rd, rm, result, cpsr & cfMask);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-
-          case 0X01C0:                    // ROR
-            cf = ((cpsr & cfMask) != 0);  // default
-            result = ror(rd, rm & 0X000000FF, &cf);
-            if (cf) {
-              cpsr = cpsr | cfMask;
-            } else {
-              cpsr = cpsr & ~cfMask;
-            }
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-
-          case 0X0200:  // TST
-            setNZ(rd & rm);
-            break;
-
-          case 0X0240:  // NEG
-            result = -rm;
-            putRegister(opCode & 7, result, regCurrent);
-            setFlags(flagSub, 0, rm, result, 1);
-            break;
-
-          case 0X0280: /* CMP (2) */
-            setFlags(flagSub, rd, rm, rd - rm, 1);
-            break;
-
-          case 0X02C0: /* CMN */
-            setFlags(flagAdd, rd, rm, rd + rm, 0);
-            break;
-
-          case 0X0300: /* ORR */
-            result = rd | rm;
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-
-          case 0X00340: /* MUL */
-            result = rm * rd;
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-
-          case 0X0380: /* BIC */
-            result = rd & ~rm;
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-
-          case 0X03C0: /* MVN */
-            result = ~rm;
-            setNZ(result);
-            putRegister(opCode & 7, result, regCurrent);
-            break;
-        }    /* End of switch */
-      } else /* special data processing */
-      {      /* NO FLAG UPDATE */
-        switch (opCode & 0X0300) {
-          case 0X0000: /* ADD (4) high registers */
-            rd = ((opCode & 0X0080) >> 4) | (opCode & 7);
-            rm = getRegister(((opCode >> 3) & 15), regCurrent);
-            putRegister(rd, getRegister(rd, regCurrent) + rm, regCurrent);
-            break;
-
-          case 0X0100: /* CMP (3) high registers */
-            rd = getRegister((((opCode & 0X0080) >> 4) | (opCode & 7)),
-                             regCurrent);
-            rm = getRegister(((opCode >> 3) & 15), regCurrent);
-            setFlags(flagSub, rd, rm, rd - rm, 1);
-            break;
-
-          case 0X0200: /* MOV (2) high registers */
-            rd = ((opCode & 0X0080) >> 4) | (opCode & 7);
-            rm = getRegister(((opCode >> 3) & 15), regCurrent);
-
-            if (rd == 15)
-              rm = rm & 0XFFFFFFFE; /* Tweak mov to PC */
-            putRegister(rd, rm, regCurrent);
-            break;
-
-          case 0X0300: /* BX/BLX Rm */
-            bx((opCode >> 3) & 0XF, opCode & 0X0080);
-            break;
-        } /* End of switch */
-      }
-    } else /* load from literal pool */
-    {      /* LDR PC */
-      rd = ((opCode >> 8) & 7);
-      address = (((opCode & 0X00FF) << 2)) +
-                (getRegister(15, regCurrent) & 0XFFFFFFFC);
-      putRegister(rd, readMemory(address, 4, false, false, memData),
-                  regCurrent);
-    }
-  } else { /* load/store word, halfword, byte, signed byte */
-    int rm, rn;
-    int data;
-
-    rd = (opCode & 7);
-    rn = getRegister(((opCode >> 3) & 7), regCurrent);
-    rm = getRegister(((opCode >> 6) & 7), regCurrent);
-
-    switch (opCode & 0X0E00) {
-      case 0X0000: /* STR (2) register */
-        writeMemory(rn + rm, getRegister(rd, regCurrent), 4, false, memData);
-        break;
+template <uint operation>
+void thumbDataOp(const decodedInstruction* decoded) {
+  const uint opCode = decoded->opCode;
+  const int rd = getRegister(opCode & 7, regCurrent);
+  const int rm = getRegister((opCode >> 3) & 7, regCurrent);
+  int cf, result;
 
-      case 0X0200: /* STRH (2) register */
-        writeMemory(rn + rm, getRegister(rd, regCurrent), 2, false, memData);
-        break;
+  switch (operation) {
+    case 0X0: /* AND */
+      result = rd & rm;
+      break;
+    case 0X1: /* EOR */
+      result = rd ^ rm;
+      break;
+    case 0X2: /* LSL (2) */
+      cf = carryFlag(); /* default */
+      result = lsl(rd, rm & 0X000000FF, &cf);
+      setCarry(cf);
+      break;
+    case 0X3: /* LSR (2) */
+      cf = carryFlag(); /* default */
+      result = lsr(rd, rm & 0X000000FF, &cf);
+      setCarry(cf);
+      break;
+    case 0X4: /* ASR (2) */
+      cf = carryFlag(); /* default */
+      result = asr(rd, rm & 0X000000FF, &cf);
+      setCarry(cf);
+      break;
+    case 0X5: /* ADC */
+      cf = carryFlag();
+      result = rd + rm + (cf ? 1 : 0);
+      setFlags(flagAdd, rd, rm, result, cf);
+      break;
+    case 0X6: /* SBC */
+      cf = carryFlag();
+      result = rd - rm - (cf ? 0 : 1);
+      setFlags(flagSub, rd, rm, result, cf);
+      break;
+    case 0X7: /* ROR */
+      cf = carryFlag(); /* default */
+      result = ror(rd, rm & 0X000000FF, &cf);
+      setCarry(cf);
+      break;
+    case 0X8: /* TST */
+      setNZ(rd & rm);
+      return;
+    case 0X9: /* NEG */
+      result = -rm;
+      setFlags(flagSub, 0, rm, result, 1);
+      break;
+    case 0XA: /* CMP (2) */
+      setFlags(flagSub, rd, rm, rd - rm, 1);
+      return;
+    case 0XB: /* CMN */
+      setFlags(flagAdd, rd, rm, rd + rm, 0);
+      return;
+    case 0XC: /* ORR */
+      result = rd | rm;
+      break;
+    case 0XD: /* MUL */
+      result = wordMultiply(rm, rd);
+      break;
+    case 0XE: /* BIC */
+      result = rd & ~rm;
+      break;
+    case 0XF: /* MVN */
+      result = ~rm;
+      break;
+  }
 
-      case 0X0400: /* STRB (2) register */
-        writeMemory(rn + rm, getRegister(rd, regCurrent), 1, false, memData);
-        break;
+  if ((operation != 0X5) && (operation != 0X6) && (operation != 0X9)) {
+    setNZ(result); /* Others set all the flags above */
+  }
+  putRegister(opCode & 7, result, regCurrent);
+}
 
-      case 0X0600: /* LDRSB register */
-        data = readMemory(rn + rm, 1, true, false, memData); /* Sign ext. */
-        putRegister(rd, data, regCurrent);
-        break;
+/**
+ * @brief ADD (4), CMP (3) and MOV (2) on any registers, and BX/BLX; other
+ * than CMP, these leave the flags alone.
+ * @tparam operation Op. code bits 9:8
+ * @param decoded
+ */
+template <uint operation>
+void thumbHighRegister(const decodedInstruction* decoded) {
+  const uint opCode = decoded->opCode;
+  const int rd = ((opCode & 0X0080) >> 4) | (opCode & 7);
+  const int rm = (opCode >> 3) & 15;
+  int value;
 
-      case 0X0800: /* LDR (2) register */
-        data = readMemory(rn + rm, 4, false, false, memData);
-        putRegister(rd, data, regCurrent);
-        break;
+  switch (operation) {
+    case 0: /* ADD (4) */
+      value = getRegister(rd, regCurrent) + getRegister(rm, regCurrent);
+      putRegister(rd, value, regCurrent);
+      break;
 
-      case 0X0A00: /* LDRH (2) register */
-        data = readMemory(rn + rm, 2, false, false, memData); /* Zero ext. */
-        putRegister(rd, data, regCurrent);
-        break;
+    case 1: /* CMP (3) */
+      value = getRegister(rd, regCurrent);
+      setFlags(flagSub, value, getRegister(rm, regCurrent),
+               value - getRegister(rm, regCurrent), 1);
+      break;
 
-      case 0X0C00:                                            /* LDRB (2) */
-        data = readMemory(rn + rm, 1, false, false, memData); /* Zero ext. */
-        putRegister(rd, data, regCurrent);
-        break;
+    case 2: /* MOV (2) */
+      value = getRegister(rm, regCurrent);
+      if (rd == 15) {
+        value = value & 0XFFFFFFFE; /* Tweak mov to PC */
+      }
+      putRegister(rd, value, regCurrent);
+      break;
 
-      case 0X0E00:                                           /* LDRSH (2) */
-        data = readMemory(rn + rm, 2, true, false, memData); /* Sign ext. */
-        putRegister(rd, data, regCurrent);
-        break;
-    }
+    case 3: /* BX/BLX Rm */
+      bx(rm, opCode & 0X0080);
+      break;
   }
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief LDR (3): from the literal pool.
+ * @param decoded
  */
-void transfer0(uint opCode) {
-  int rd, rn;
-  int location, data;
-
-  rn = getRegister(((opCode >> 3) & 7), regCurrent);
+void thumbLoadLiteral(const decodedInstruction* decoded) {
+  const uint opCode = decoded->opCode;
+  const uint address = ((opCode & 0X00FF) << 2) +
+                       (getRegister(15, regCurrent) & 0XFFFFFFFC);
 
-  if ((opCode & 0X0800) == 0) /* STR */
-  {
-    rd = getRegister((opCode & 7), regCurrent);
-    if ((opCode & 0X1000) == 0) /* STR (1) 5-bit imm */
-    {
-      location = rn + ((opCode >> 4) & 0X07C); /* shift twice = *4 */
-      writeMemory(location, rd, 4, false, memData);
-    } else /* STRB (1) */
-    {
-      location = rn + ((opCode >> 6) & 0X1F);
-      writeMemory(location, rd, 1, false, memData);
-    }
-  } else /* LDR (1) */
-  {
-    rd = opCode & 7;
-    if ((opCode & 0X1000) == 0) {
-      location = (rn + ((opCode >> 4) & 0X07C)); /* shift twice = *4 */
-      data = readMemory(location, 4, false, false, memData);
-    } else /* LDRB (1) */
-    {
-      location = (rn + ((opCode >> 6) & 0X1F));
-      data = readMemory(location, 1, false, false, memData); /* Zero extended */
-    }
-    putRegister(rd, data, regCurrent);
-  }
+  putRegister((opCode >> 8) & 7, readMemory(address, 4, false, false, memData),
+              regCurrent);
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief Loads and stores with a register offset.
+ * @tparam operation Op. code bits 11:9
+ * @param decoded
  */
-void transfer1(uint opCode) {
-  int rd, rn;
-  int data, location;
+template <uint operation>
+void thumbTransferRegister(const decodedInstruction* decoded) {
+  const uint opCode = decoded->opCode;
+  const int rd = opCode & 7;
+  const uint address = getRegister((opCode >> 3) & 7, regCurrent) +
+                       getRegister((opCode >> 6) & 7, regCurrent);
 
-  switch (opCode & 0X1800) {
-    case 0X0000: /* STRH (1) */
-      rn = getRegister((opCode >> 3) & 7, regCurrent);
-      rd = opCode & 7;
-      data = getRegister(rd, regCurrent);
-      location = rn + ((opCode >> 5) & 0X3E); /* x2 in shift */
-      writeMemory(location, data, 2, false, memData);
+  switch (operation) {
+    case 0: /* STR (2) */
+      writeMemory(address, getRegister(rd, regCurrent), 4, false, memData);
       break;
-
-    case 0X0800: /* LDRH (1) */
-      rd = opCode & 7;
-      rn = getRegister((opCode >> 3) & 7, regCurrent);
-      location = rn + ((opCode >> 5) & 0X3E);                /* x2 in shift */
-      data = readMemory(location, 2, false, false, memData); /* Zero extended */
-      putRegister(rd, data, regCurrent);
+    case 1: /* STRH (2) */
+      writeMemory(address, getRegister(rd, regCurrent), 2, false, memData);
       break;
-
-    case 0X1000: /* STR (3) -SP */
-      data = getRegister(((opCode >> 8) & 7), regCurrent);
-      rn = getRegister(13, regCurrent); /* SP */
-      location = rn + ((opCode & 0X00FF) * 4);
-      writeMemory(location, data, 4, false, memData);
+    case 2: /* STRB (2) */
+      writeMemory(address, getRegister(rd, regCurrent), 1, false, memData);
       break;
-
-    case 0X1800: /* LDR (4) -SP */
-      rd = (opCode >> 8) & 7;
-      rn = getRegister(13, regCurrent);        /* SP */
-      location = rn + ((opCode & 0X00FF) * 4); /* x2 in shift */
-      data = readMemory(location, 4, false, false, memData);
-      putRegister(rd, data, regCurrent);
+    case 3: /* LDRSB */
+      putRegister(rd, readMemory(address, 1, true, false, memData),
+                  regCurrent);
+      break;
+    case 4: /* LDR (2) */
+      putRegister(rd, readMemory(address, 4, false, false, memData),
+                  regCurrent);
+      break;
+    case 5: /* LDRH (2) */
+      putRegister(rd, readMemory(address, 2, false, false, memData),
+                  regCurrent);
+      break;
+    case 6: /* LDRB (2) */
+      putRegister(rd, readMemory(address, 1, false, false, memData),
+                  regCurrent);
+      break;
+    case 7: /* LDRSH */
+      putRegister(rd, readMemory(address, 2, true, false, memData),
+                  regCurrent);
       break;
   }
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief LDR/STR (1), LDRB/STRB (1) and LDRH/STRH (1): a 5-bit offset,
+ * scaled by the size.
+ * @tparam load
+ * @tparam size In bytes
+ * @param decoded
  */
-void spPC(uint opCode) {
-  int rd, sp, data;
+template <bool load, int size>
+void thumbTransferImmediate(const decodedInstruction* decoded) {
+  const uint opCode = decoded->opCode;
+  const uint address = getRegister((opCode >> 3) & 7, regCurrent) +
+                       ((opCode >> 6) & 0X1F) * size;
+
+  if (load) {
+    putRegister(opCode & 7, readMemory(address, size, false, false, memData),
+                regCurrent);
+  } else {
+    writeMemory(address, getRegister(opCode & 7, regCurrent), size, false,
+                memData);
+  }
+}
 
-  if ((opCode & 0X1000) == 0) /* ADD SP or PC */
-  {
-    rd = (opCode >> 8) & 7;
-
-    if ((opCode & 0X0800) == 0) /* ADD(5) -PC */
-      data =
-          (getRegister(15, regCurrent) & 0XFFFFFFFC) + ((opCode & 0X00FF) << 2);
-    /* getRegister supplies PC + 2 */
-    else /* ADD(6) -SP */
-      data = (getRegister(13, regCurrent)) + ((opCode & 0X00FF) << 2);
-    putRegister(rd, data, regCurrent);
-  } else /* Adjust SP */
-  {
-    switch (opCode & 0X0F00) {
-      case 0X0000:
-        if ((opCode & 0X0080) == 0) /* ADD(7) -SP */
-          sp = getRegister(13, regCurrent) + ((opCode & 0X7F) << 2);
-        else /* SUB(4) -SP */
-          sp = getRegister(13, regCurrent) - ((opCode & 0X7F) << 2);
-        putRegister(13, sp, regCurrent);
-        break;
+/**
+ * @brief LDR (4) and STR (3): relative to SP.
+ * @tparam load
+ * @param decoded
+ */
+template <bool load>
+void thumbTransferSP(const decodedInstruction* decoded) {
+  const uint opCode = decoded->opCode;
+  const int rd = (opCode >> 8) & 7;
+  const uint address = getRegister(13, regCurrent) + ((opCode & 0X00FF) * 4);
+
+  if (load) {
+    putRegister(rd, readMemory(address, 4, false, false, memData),
+                regCurrent);
+  } else {
+    writeMemory(address, getRegister(rd, regCurrent), 4, false, memData);
+  }
+}
 
-      case 0X0400:
-      case 0X0500:
-      case 0X0C00:
-      case 0X0D00: {
-        int reg_list;
-
-        reg_list = opCode & 0X000000FF;
-
-        if ((opCode & 0X0800) == 0) /* PUSH */
-        {
-          if ((opCode & 0X0100) != 0)
-            reg_list = reg_list | 0X4000;
-          stm(2, 13, reg_list, 1, 0);
-        } else /* POP */
-        {
-          if ((opCode & 0X0100) != 0)
-            reg_list = reg_list | 0X8000;
-          ldm(1, 13, reg_list, 1, 0);
-        }
-      } break;
+/**
+ * @brief ADD (5) and ADD (6): an address relative to PC or SP.
+ * @tparam sp
+ * @param decoded
+ */
+template <bool sp>
+void thumbAddress(const decodedInstruction* decoded) {
+  const uint opCode = decoded->opCode;
+  const uint base = sp ? getRegister(13, regCurrent)
+                       : (getRegister(15, regCurrent) & 0XFFFFFFFC);
+
+  /* getRegister supplies PC + 2 */
+  putRegister((opCode >> 8) & 7, base + ((opCode & 0X00FF) << 2), regCurrent);
+}
 
-      case 0X0E00: /* Breakpoint */
-        //      fprintf(stderr, "Breakpoint\n");
-        breakpoint();
-        break;
+/**
+ * @brief ADD (7) and SUB (4): adjust SP.
+ * @tparam subtract
+ * @param decoded
+ */
+template <bool subtract>
+void thumbAdjustSP(const decodedInstruction* decoded) {
+  const uint offset = (decoded->opCode & 0X7F) << 2;
+  const uint sp = getRegister(13, regCurrent);
 
-      case 0X0100:
-      case 0X0200:
-      case 0X0300:
-      case 0X0600:
-      case 0X0700:
-      case 0X0800:
-      case 0X0900:
-      case 0X0A00:
-      case 0X0B00:
-      case 0X0F00:
-        //      fprintf(stderr, "Undefined\n");
-        undefined();
-        break;
+  putRegister(13, subtract ? sp - offset : sp + offset, regCurrent);
+}
+
+/**
+ * @brief PUSH and POP, optionally with LR or PC respectively.
+ * @tparam pop
+ * @param decoded
+ */
+template <bool pop>
+void thumbPushPop(const decodedInstruction* decoded) {
+  const uint opCode = decoded->opCode;
+  int regList = opCode & 0X000000FF;
+
+  if (pop) {
+    if ((opCode & 0X0100) != 0) {
+      regList = regList | 0X8000;
     }
+    ldm(1, 13, regList, 1, 0);
+  } else {
+    if ((opCode & 0X0100) != 0) {
+      regList = regList | 0X4000;
+    }
+    stm(2, 13, regList, 1, 0);
   }
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief LDMIA and STMIA.
+ * @tparam load
+ * @param decoded
  */
-void lsmB(uint opCode) {
-  uint offset;
+template <bool load>
+void thumbMultiple(const decodedInstruction* decoded) {
+  const uint opCode = decoded->opCode;
 
-  if ((opCode & 0X1000) == 0) {
-    if ((opCode & 0X0800) == 0) /* STM (IA) */
-      stm(1, (opCode >> 8) & 7, opCode & 0X000000FF, 1, 0);
-    else /* LDM (IA) */
-      ldm(1, (opCode >> 8) & 7, opCode & 0X000000FF, 1, 0);
-  } else /* conditional BRANCH B(1) */
-  {
-    if ((opCode & 0X0F00) != 0X0F00) /* Branch, not a SWI */
-    {
-      if (checkCC(opCode >> 8) == true) {
-        offset = (opCode & 0X00FF) << 1; /* sign extend */
-        if ((opCode & 0X0080) != 0)
-          offset = offset | 0XFFFFFE00;
-
-        putRegister(15, getRegister(15, regCurrent) + offset, regCurrent);
-        /* getRegister supplies pc + 2 */
-        /*    fprintf(stderr, "%08X", address + 4 + offset); */
-      }
-    } else /* SWI */
-    {
-      offset = opCode & 0X00FF;
-      /* bodge opCode to pass only SWI No. N.B. no copro in Thumb */
-      mySystem(offset);
-    }
+  if (load) {
+    ldm(1, (opCode >> 8) & 7, opCode & 0X000000FF, 1, 0);
+  } else {
+    stm(1, (opCode >> 8) & 7, opCode & 0X000000FF, 1, 0);
   }
 }
 
 /**
- * @brief
- * @param opCode
- * @param exchange
+ * @brief B (1) and B (2); the condition and offset are extracted when decoded.
+ * @param decoded
  */
-void thumbBranch1(uint opCode, int exchange) {
-  int offset, lr;
+void thumbBranch(const decodedInstruction* decoded) {
+  /* getRegister supplies PC + 2 */
+  putRegister(15, getRegister(15, regCurrent) + decoded->offset, regCurrent);
+}
 
-  lr = getRegister(14, regCurrent); /* Retrieve first part of offset */
-  offset = lr + ((opCode & 0X07FF) << 1);
+/**
+ * @brief SWI; passes only the SWI number. N.B. no copro in Thumb.
+ * @param decoded
+ */
+void thumbSWI(const decodedInstruction* decoded) {
+  mySystem(decoded->opCode & 0X00FF);
+}
 
-  lr = getRegister(15, regCurrent) - 2 + 1; /* + 1 to indicate Thumb mode */
+/**
+ * @brief The first half of BL/BLX: the upper offset is left in LR.
+ * @param decoded
+ */
+void thumbBranchPrefix(const decodedInstruction* decoded) {
+  int offset;
 
-  if (exchange == true) {
-    cpsr = cpsr & ~tfMask; /* Change to ARM mode */
-    offset = offset & 0XFFFFFFFC;
-  }
+  machine->BLPrefix = decoded->opCode & 0X07FF;
+  offset = machine->BLPrefix << 12;
 
-  putRegister(15, offset, regCurrent);
-  putRegister(14, lr, regCurrent);
+  if ((machine->BLPrefix & 0X0400) != 0) {
+    offset = offset | 0XFF800000; /* Sign ext. */
+  }
+  putRegister(14, getRegister(15, regCurrent) + offset, regCurrent);
 }
 
 /**
- * @brief
- * @param opCode
+ * @brief The second half of BL/BLX.
+ * @tparam exchange BLX, to ARM
+ * @param decoded
  */
-void thumbBranch(uint opCode) {
-  int offset;
-
-  switch (opCode & 0X1800) {
-    case 0X0000: /* B -uncond. B(2)  */
-      offset = (opCode & 0X07FF) << 1;
-      if ((opCode & 0X0400) != 0)
-        offset = offset | 0XFFFFF000; /* sign extend */
-      putRegister(15, (getRegister(15, regCurrent) + offset), regCurrent);
-      break;
+template <bool exchange>
+void thumbBranchSuffix(const decodedInstruction* decoded) {
+  const uint opCode = decoded->opCode;
+  int offset, lr;
 
-    case 0X0800: /* BLX */
-      if ((opCode & 0X0001) == 0)
-        thumbBranch1(opCode, true);
-      else
-        fprintf(stderr, "Undefined\n");
-      break;
+  if (exchange && ((opCode & 0X0001) != 0)) {
+    fprintf(stderr, "Undefined\n");
+    return;
+  }
 
-    case 0X1000: /* BL prefix */
-      BLPrefix = opCode & 0X07FF;
-      offset = BLPrefix << 12;
+  lr = getRegister(14, regCurrent); /* Retrieve first part of offset */
+  offset = lr + ((opCode & 0X07FF) << 1);
 
-      if ((BLPrefix & 0X0400) != 0)
-        offset = offset | 0XFF800000; /* Sign ext. */
-      offset = getRegister(15, regCurrent) + offset;
-      putRegister(14, offset, regCurrent);
-      break;
+  lr = getRegister(15, regCurrent) - 2 + 1; /* + 1 to indicate Thumb mode */
 
-    case 0X1800:
-      thumbBranch1(opCode, false);
-      break;
+  if (exchange) {
+    machine->cpsr = machine->cpsr & ~tfMask; /* Change to ARM mode */
+    offset = offset & 0XFFFFFFFC;
   }
+
+  putRegister(15, offset, regCurrent);
+  putRegister(14, lr, regCurrent);
 }
 
 /**
@@ -3420,9 +5269,15 @@ void thumbBranch(uint opCode) {
  * @return uint
  */
 uint getmem32(int number) {
-  number = number % RAMSIZE;
-  return memory[(number << 2)] | memory[(number << 2) + 1] << 8 |
-         memory[(number << 2) + 2] << 16 | memory[(number << 2) + 3] << 24;
+  number = number & ((RAMSIZE >> 2) - 1);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint word;
+  memcpy(&word, &machine->memory[number << 2], 4);  // Single native load
+  return word;
+#else
+  const uchar* bytes = &machine->memory[number << 2];
+  return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | bytes[3] << 24;
+#endif
 }
 
 /**
@@ -3431,11 +5286,65 @@ uint getmem32(int number) {
  * @param reg
  */
 void setmem32(int number, uint reg) {
-  number = number & (RAMSIZE - 1);
-  memory[(number << 2) + 0] = (reg >> 0) & 0xff;
-  memory[(number << 2) + 1] = (reg >> 8) & 0xff;
-  memory[(number << 2) + 2] = (reg >> 16) & 0xff;
-  memory[(number << 2) + 3] = (reg >> 24) & 0xff;
+  number = number & ((RAMSIZE >> 2) - 1);
+  preservePages(number << 2, 4);
+  invalidateDecodeCache(number << 2, 4);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(&machine->memory[number << 2], &reg, 4);  // Single native store
+#else
+  machine->memory[(number << 2) + 0] = (reg >> 0) & 0xff;
+  machine->memory[(number << 2) + 1] = (reg >> 8) & 0xff;
+  machine->memory[(number << 2) + 2] = (reg >> 16) & 0xff;
+  machine->memory[(number << 2) + 3] = (reg >> 24) & 0xff;
+#endif
+}
+
+/**
+ * @brief Read an aligned half-word.
+ * @param number Half-word index
+ * @return uint
+ */
+uint getmem16(int number) {
+  number = number & ((RAMSIZE >> 1) - 1);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  unsigned short half;
+  memcpy(&half, &machine->memory[number << 1], 2);
+  return half;
+#else
+  const uchar* bytes = &machine->memory[number << 1];
+  return bytes[0] | bytes[1] << 8;
+#endif
+}
+
+/**
+ * @brief Write an aligned half-word.
+ * @param number Half-word index
+ * @param reg
+ */
+void setmem16(int number, uint reg) {
+  number = number & ((RAMSIZE >> 1) - 1);
+  preservePages(number << 1, 2);
+  invalidateDecodeCache(number << 1, 2);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  unsigned short half = reg;
+  memcpy(&machine->memory[number << 1], &half, 2);
+#else
+  machine->memory[(number << 1) + 0] = (reg >> 0) & 0xff;
+  machine->memory[(number << 1) + 1] = (reg >> 8) & 0xff;
+#endif
+}
+
+/**
+ * @brief The word containing a misaligned address, rotated so the addressed
+ * byte is at the bottom (the ARM unaligned load behaviour).
+ * @param address
+ * @return uint
+ */
+uint rotatedWord(uint address) {
+  const uint data = getmem32(address >> 2);
+  const uint shift = 8 * (address & 3);
+
+  return (shift == 0) ? data : (data >> shift) | (data << (32 - shift));
 }
 
 /**
@@ -3453,12 +5362,7 @@ void initBuffer(ringBuffer* buffer) {
  * @return int
  */
 int countBuffer(ringBuffer* buffer) {
-  int i = buffer->iHead - buffer->iTail;
-
-  if (i < 0) {
-    i = i + RING_BUF_SIZE;
-  }
-  return i;
+  return buffer->iHead - buffer->iTail;  // Correct across wrap round
 }
 
 /**
@@ -3468,11 +5372,9 @@ int countBuffer(ringBuffer* buffer) {
  * @return int
  */
 bool putBuffer(ringBuffer* buffer, const uchar c) {
-  uint temp = (buffer->iHead + 1) % RING_BUF_SIZE;
-
-  if (temp != buffer->iTail) {
-    buffer->buffer[temp] = c;
-    buffer->iHead = temp;
+  if (buffer->iHead - buffer->iTail != RING_BUF_SIZE) {
+    buffer->buffer[buffer->iHead & (RING_BUF_SIZE - 1)] = c;
+    buffer->iHead++;
     return true;
   }
 
@@ -3487,10 +5389,50 @@ bool putBuffer(ringBuffer* buffer, const uchar c) {
  */
 bool getBuffer(ringBuffer* buffer, uchar* c) {
   if (buffer->iTail != buffer->iHead) {
-    buffer->iTail = (buffer->iTail + 1) % RING_BUF_SIZE;
-    *c = buffer->buffer[buffer->iTail];
+    *c = buffer->buffer[buffer->iTail & (RING_BUF_SIZE - 1)];
+    buffer->iTail++;
     return true;
   }
 
   return false;
 }
+
+/**
+ * @brief Puts as much of a block as there is room for.
+ * @param buffer
+ * @param data
+ * @param length
+ * @return uint The number of bytes put.
+ */
+uint putBufferBlock(ringBuffer* buffer, const uchar* data, uint length) {
+  const uint start = buffer->iHead & (RING_BUF_SIZE - 1);
+
+  length = std::min(length, RING_BUF_SIZE - (buffer->iHead - buffer->iTail));
+
+  const uint first = std::min(length, RING_BUF_SIZE - start);  // Before wrap
+
+  memcpy(&buffer->buffer[start], data, first);
+  memcpy(buffer->buffer, data + first, length - first);
+  buffer->iHead += length;
+  return length;
+}
+
+/**
+ * @brief Gets up to a given number of bytes, oldest first.
+ * @param buffer
+ * @param data
+ * @param length Most to get
+ * @return uint The number of bytes got.
+ */
+uint getBufferBlock(ringBuffer* buffer, uchar* data, uint length) {
+  const uint start = buffer->iTail & (RING_BUF_SIZE - 1);
+
+  length = std::min(length, buffer->iHead - buffer->iTail);
+
+  const uint first = std::min(length, RING_BUF_SIZE - start);  // Before wrap
+
+  memcpy(data, &buffer->buffer[start], first);
+  memcpy(data + first, buffer->buffer, length - first);
+  buffer->iTail += length;
+  return length;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file multiply.h
+ * @brief The arithmetic of the multiplies (MUL, MLA and the long UMULL,
+ * UMLAL, SMULL, SMLAL), shared by jimulator and the checks in src/testSrc.
+ */
+
+#include <stdint.h>
+
+/**
+ * @brief The result of MUL (ARM or Thumb) or the product in MLA: the low word
+ * of the product, which is the same signed or not. Done unsigned, since
+ * signed overflow is undefined.
+ * @param rm The first operand.
+ * @param rs The second operand.
+ * @return The low 32 bits of rm * rs.
+ */
+inline uint32_t wordMultiply(const uint32_t rm, const uint32_t rs) {
+  return rm * rs;
+}
+
+/**
+ * @brief RdHi:RdLo for a long multiply, modulo 2^64.
+ * @param rm The first operand.
+ * @param rs The second operand.
+ * @param isSigned Sign-extend both operands first (SMULL, SMLAL).
+ * @param accumulator The old RdHi:RdLo for UMLAL and SMLAL, else 0.
+ * @return The 64-bit result.
+ */
+inline uint64_t longMultiply(const uint32_t rm,
+                             const uint32_t rs,
+                             const bool isSigned,
+                             const uint64_t accumulator) {
+  const uint64_t product = isSigned
+                               ? (uint64_t)((int64_t)(int32_t)rm * (int32_t)rs)
+                               : (uint64_t)rm * rs;
+
+  return product + accumulator;
+}
+
+/**
+ * @brief A word for setNZ with the flags of a 64-bit result: N from bit 63
+ * and Z from all 64 bits.
+ * @param result The long multiply result.
+ * @return The word.
+ */
+inline uint32_t longMultiplyNZ(const uint64_t result) {
+  return (uint32_t)(result >> 32) | ((uint32_t)result != 0);
+}
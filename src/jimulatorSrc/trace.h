@@ -0,0 +1,40 @@
+/**
+ * @file trace.h
+ * @brief The layout of the binary execution trace written by jimulator (-t)
+ * and read by jimtrace. The file is a traceHeader followed by a ring of
+ * "capacity" traceRecords, the oldest being overwritten once it is full.
+ * Every retired instruction is a traceInstruction record, followed by a
+ * traceWrite record for each memory write it made.
+ */
+
+#include <stdint.h>
+
+constexpr const char traceMagic[8] = {'J', 'I', 'M', 'T', 'R', 'A', 'C', 'E'};
+constexpr const uint32_t traceVersion = 1;
+
+constexpr const uint8_t traceInstruction = 1;  // Kinds of record
+constexpr const uint8_t traceWrite = 2;
+
+/**
+ * @brief The start of a trace file.
+ */
+struct traceHeader {
+  char magic[8];        // traceMagic
+  uint32_t version;     // traceVersion
+  uint32_t recordSize;  // sizeof(traceRecord)
+  uint32_t capacity;    // Records in the ring; a power of 2
+  uint32_t spare;
+  uint64_t written;  // Records ever written; the next is at written % capacity
+};
+
+/**
+ * @brief One instruction, or one memory write.
+ */
+struct traceRecord {
+  uint8_t kind;
+  uint8_t size;  // Bytes written, or of the op. code (2 for Thumb)
+  uint16_t spare;
+  uint32_t address;  // PC of the instruction, or where written
+  uint32_t value;    // Op. code, or what was written
+  uint32_t cpsr;     // After the instruction (traceInstruction)
+};
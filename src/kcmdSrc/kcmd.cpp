@@ -10,6 +10,7 @@
 
 #include "kcmd.h"
 #include <ctype.h>
+#include <elf.h>
 #include <fcntl.h>
 #include <math.h>
 #include <signal.h>
@@ -17,6 +18,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/poll.h>
+#include <sys/mman.h>
 #include <sys/signal.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -72,6 +74,21 @@ constexpr int ADDRESS_BUS_WIDTH = 4;
  */
 constexpr int MAX_NUMBER_OF_BREAKPOINTS = 32;
 
+/**
+ * @brief The number of instructions listed by the profile (`-p`) report.
+ */
+constexpr int HOT_SPOT_COUNT = 20;
+
+/**
+ * @brief The size of Jimulator's memory; loaded segments must fit in it.
+ */
+constexpr unsigned int MEMORY_SIZE = 0x100000;
+
+/**
+ * @brief The number of zero bytes sent at once to fill a segment's .bss.
+ */
+constexpr int ZERO_FILL_CHUNK = 0x1000;
+
 // Communication pipes
 int communicationFromJimulator[2];
 int communicationToJimulator[2];
@@ -132,10 +149,13 @@ enum class BoardInstruction : unsigned char {
   STOP = 0x21,
   CONTINUE = 0x23,
   RESET = 0x04,
+  PROFILE_SET = 0x27,
+  PROFILE_GET = 0x28,
 
   // Terminal read/write
   FR_WRITE = 0x12,
   FR_READ = 0x13,
+  FR_READ_ALL = 0x14,
 
   // Breakpoint read/write
   BP_WRITE = 0x30,
@@ -145,11 +165,12 @@ enum class BoardInstruction : unsigned char {
 
   // Register read/write
   GET_REG = 0x5A,
-  SET_REG = 0x52,  // Unused
+  SET_REG = 0x52,
 
   // Memory read/write
   GET_MEM = 0x4A,
   SET_MEM = 0x40,
+  SET_MEM_IMAGE = 0x60,
 };
 
 /**
@@ -219,6 +240,34 @@ class sourceFile {
   SourceFileLine* pEnd;
 };
 
+/**
+ * @brief Memory contents gathered while loading, to be sent as one
+ * SET_MEM_IMAGE message.
+ */
+class MemoryImage {
+ public:
+  /**
+   * @brief The message: the command, a 4-byte extent count, then each extent
+   * as a 4-byte address, a 4-byte length and the bytes.
+   */
+  std::vector<unsigned char> message;
+
+  /**
+   * @brief The number of extents in the message.
+   */
+  unsigned int extentCount;
+
+  /**
+   * @brief Where in the message the length of the last extent is.
+   */
+  size_t lastLength;
+
+  /**
+   * @brief The address just after the last extent.
+   */
+  unsigned int nextAddress;
+};
+
 /**
  * @brief The source file that is currently loaded into Jimulator.
  */
@@ -230,6 +279,9 @@ sourceFile source;
 
 inline void flushSourceFile();
 inline const bool readSourceFile(const char* const);
+inline const bool readELFFile(const char* const);
+inline void imageAppend(MemoryImage*, unsigned int, unsigned char*, int);
+inline void boardSetMemoryImage(MemoryImage*);
 inline const ClientState getBoardStatus();
 inline const std::array<unsigned char, 64> readRegistersIntoArray();
 constexpr const int disassembleSourceFile(SourceFileLine*, unsigned int);
@@ -328,6 +380,18 @@ const bool Jimulator::loadJimulator(const char* const pathToKMD) {
   return readSourceFile(pathToKMD);
 }
 
+/**
+ * @brief Clears the existing `source` object and loads the ELF executable at
+ * `pathToELF` into Jimulator, starting at its entry point. An ELF file has no
+ * source text, so none is shown.
+ * @param pathToELF a path to the ELF executable that will be loaded.
+ * @return true if successful, false otherwise.
+ */
+const bool Jimulator::loadJimulatorELF(const char* const pathToELF) {
+  flushSourceFile();
+  return readELFFile(pathToELF);
+}
+
 /**
  * @brief Commences running the emulator.
  * @param steps The number of steps to run for (0 for indefinite)
@@ -468,26 +532,73 @@ const std::array<std::string, 16> Jimulator::getJimulatorRegisterValues() {
  * @return const std::string The message to be displayed in the terminal output.
  */
 const std::string Jimulator::getJimulatorTerminalMessages() {
-  unsigned char string[256];  // Arbitrary size
-  unsigned char length = 1;
+  int length;
 
-  std::string output("");
+  // Everything buffered, in one reply
+  sendChar(static_cast<unsigned char>(BoardInstruction::FR_READ_ALL));
+  sendChar(0);  // send the terminal number
+  if ((getNBytes(&length, 4) != 4) || (length <= 0)) {
+    return "";
+  }
 
-  while (length > 0) {
-    sendChar(static_cast<unsigned char>(BoardInstruction::FR_READ));
-    sendChar(0);  // send the terminal number
-    sendChar(32);
-    getChar(&length);  // get length of message
-
-    // non-zero received from board - not an empty packet
-    if (length != 0) {
-      getCharArray(length, string);  // Store the message
-      string[length] = '\0';
-      output.append((char*)string);
+  std::string output(length, '\0');
+  output.resize(
+      getCharArray(length, reinterpret_cast<unsigned char*>(&output[0])));
+  return output;
+}
+
+/**
+ * @brief Has Jimulator count how many times each instruction is executed,
+ * from zero.
+ */
+void Jimulator::startProfiling() {
+  sendChar(static_cast<unsigned char>(BoardInstruction::PROFILE_SET));
+  sendChar(1);
+}
+
+/**
+ * @brief Reads the most executed instructions since `startProfiling()`, and
+ * pairs each with its line of the loaded source file.
+ * @param count The number of instructions to list.
+ * @return const std::string One line per instruction, hottest first: the
+ * count, address and source text.
+ */
+const std::string Jimulator::getJimulatorHotSpots(const int count) {
+  std::vector<std::pair<int, int>> spots;
+  std::unordered_map<u_int32_t, const char*> text;
+  std::stringstream ss;
+  int n;
+
+  sendChar(static_cast<unsigned char>(BoardInstruction::PROFILE_GET));
+  sendNBytes(count, 2);
+  if (getNBytes(&n, 4) != 4) {
+    return "";
+  }
+
+  for (int i = 0; i < n; i++) {
+    int address, executions;
+
+    getNBytes(&address, 4);
+    getNBytes(&executions, 4);
+    spots.push_back(std::make_pair(address, executions));
+    text[address] = "";
+  }
+
+  // Join with the source, first line at an address winning
+  for (SourceFileLine* src = source.pEnd; src != NULL; src = src->prev) {
+    if (src->hasData && (text.count(src->address) != 0)) {
+      text[src->address] = src->text;
     }
   }
 
-  return output;
+  for (const auto& spot : spots) {
+    ss << std::setw(12) << static_cast<unsigned int>(spot.second) << "  "
+       << std::setfill('0') << std::setw(8) << std::uppercase << std::hex
+       << spot.first << std::setfill(' ') << std::dec << " "
+       << text[spot.first] << "\n";
+  }
+
+  return ss.str();
 }
 
 /**
@@ -973,7 +1084,7 @@ inline const int getNBytes(int* data, int n) {
   *data = 0;
 
   for (int i = 0; i < numberOfReceivedBytes; i++) {
-    *data = *data | (getLeastSignificantByte(buffer[i]) << (i * 8));
+    *data = *data | ((unsigned int)buffer[i] << (i * 8));  // No sign overflow
   }
 
   return numberOfReceivedBytes;
@@ -1242,41 +1353,66 @@ constexpr const int readNumberFromFile(FILE* const f,
 }
 
 /**
- * @brief Converts a provided memory size into a Jimulator legal memory size.
- * @param size The size to convert.
- * @return unsigned int The Jimulator legal size.
- */
-constexpr const unsigned int boardTranslateMemsize(const int size) {
-  switch (size) {
-    case 1:
-      return 0;
-    case 2:
-      return 1;
-    case 4:
-      return 2;
-    case 8:
-      return 3;
-    default:
-      return 0;
+ * @brief Stores a 32-bit value, little-endian, into a message.
+ * @param message Where to store it.
+ * @param value The value to store.
+ */
+inline void storeWord(unsigned char* const message, const unsigned int value) {
+  for (int i = 0; i < 4; i++) {
+    message[i] = getLeastSignificantByte(value >> (8 * i));
+  }
+}
+
+/**
+ * @brief Adds bytes to be loaded into memory to an image. Bytes following on
+ * from the last extent lengthen it rather than starting another.
+ * @param image The image being gathered.
+ * @param address Where the bytes go.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ */
+inline void imageAppend(MemoryImage* image,
+                        unsigned int address,
+                        unsigned char* data,
+                        int size) {
+  if (image->message.empty()) {
+    image->message.resize(5);  // Command and extent count, filled in later
+    image->extentCount = 0;
+  } else if (address == image->nextAddress) {
+    const size_t length = image->message.size() - image->lastLength - 4;
+
+    storeWord(&image->message[image->lastLength], length + size);
+    image->message.insert(image->message.end(), data, data + size);
+    image->nextAddress = address + size;
+    return;
   }
+
+  const size_t start = image->message.size();
+
+  image->message.resize(start + 8);
+  storeWord(&image->message[start], address);
+  storeWord(&image->message[start + 4], size);
+  image->message.insert(image->message.end(), data, data + size);
+  image->extentCount++;
+  image->lastLength = start + 4;
+  image->nextAddress = address + size;
 }
 
 /**
- * @brief Sets a memory value of a given address to a new value.
- * This code is LEGACY. It used to run with a check on `board_version`:
- * however `board_version` always passed the check due to the certainty of the
- * "hardware" run under the emulator; therefore the check has been removed.
- * @param address pointer to the address (in bytes)
- * @param value pointer to the new value to be stored
- * @param size width of current memory (in bytes)
- */
-inline void boardSetMemory(unsigned char* const address,
-                           unsigned char* const value,
-                           const int size) {
-  sendChar(BoardInstruction::SET_MEM | boardTranslateMemsize(size));
-  sendCharArray(ADDRESS_BUS_WIDTH, address);  // send address
-  sendNBytes(1, 2);                           // send width
-  sendCharArray(size, value);
+ * @brief Loads a gathered image into Jimulator's memory in one write; the
+ * extents are written in the order they were gathered.
+ * @param image The image, which is emptied.
+ */
+inline void boardSetMemoryImage(MemoryImage* image) {
+  if (image->message.empty()) {
+    return;  // Nothing to load
+  }
+
+  image->message[0] = static_cast<unsigned char>(
+      BoardInstruction::SET_MEM_IMAGE);
+  storeWord(&image->message[1], image->extentCount);
+  sendCharArray(image->message.size(), image->message.data());
+  image->message.clear();
 }
 
 /**
@@ -1291,6 +1427,7 @@ inline const bool readSourceFile(const char* const pathToKMD) {
   int byteTotal, textLength;
   char buffer[SOURCE_TEXT_LENGTH + 1];  // + 1 for terminator
   SourceFileLine* currentLine;
+  MemoryImage image;
 
   // `system` runs the paramter string as a shell command (i.e. it launches a
   // new process) `pidof` checks to see if a process by the name `jimulator` is
@@ -1390,19 +1527,15 @@ inline const bool readSourceFile(const char* const pathToKMD) {
 
             if ((currentLine->dataSize[j] > 0) &&
                 ((currentLine->dataSize[j] + byteTotal) <= SOURCE_BYTE_COUNT)) {
-              unsigned char addr[4], data[4];
+              unsigned char data[4];
 
-              for (int i = 0; i < 4; i++) {
-                addr[i] =
-                    getLeastSignificantByte((address + byteTotal) >> (8 * i));
-              }
               for (int i = 0; i < currentLine->dataSize[j]; i++) {
                 data[i] = getLeastSignificantByte(currentLine->dataValue[j] >>
                                                   (8 * i));
               }
 
-              // Ignore Boolean error return value for now
-              boardSetMemory(addr, data, currentLine->dataSize[j]);
+              imageAppend(&image, address + byteTotal, data,
+                          currentLine->dataSize[j]);
             }
 
             byteTotal = byteTotal + currentLine->dataSize[j];
@@ -1469,6 +1602,107 @@ inline const bool readSourceFile(const char* const pathToKMD) {
   }
 
   fclose(komodoSource);
+  boardSetMemoryImage(&image);  // All of it at once
+  return true;
+}
+
+/**
+ * @brief Sends the loadable segments of an ARM ELF executable, mapped rather
+ * than read, as one SET_MEM_IMAGE message, and sets the PC to its entry point.
+ * @param pathToELF A path to the executable.
+ * @return true if successful, false otherwise.
+ */
+inline const bool readELFFile(const char* const pathToELF) {
+  const int fd = open(pathToELF, O_RDONLY);
+  struct stat status;
+
+  if ((fd < 0) || (fstat(fd, &status) != 0)) {
+    std::cout << "ELF file could not be opened!\n";
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+
+  const size_t length = status.st_size;
+  void* mapped = (length < sizeof(Elf32_Ehdr))
+                     ? MAP_FAILED
+                     : mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);  // The mapping keeps the file
+
+  if (mapped == MAP_FAILED) {
+    std::cout << "Not an ELF file!\n";
+    return false;
+  }
+
+  unsigned char* const image = static_cast<unsigned char*>(mapped);
+  const Elf32_Ehdr* const header = static_cast<const Elf32_Ehdr*>(mapped);
+  const Elf32_Phdr* const segments =
+      reinterpret_cast<const Elf32_Phdr*>(image + header->e_phoff);
+  bool valid = (memcmp(header->e_ident, ELFMAG, SELFMAG) == 0) &&
+               (header->e_ident[EI_CLASS] == ELFCLASS32) &&
+               (header->e_ident[EI_DATA] == ELFDATA2LSB) &&
+               (header->e_machine == EM_ARM) &&
+               (header->e_phentsize == sizeof(Elf32_Phdr)) &&
+               (header->e_phoff <= length) &&
+               ((length - header->e_phoff) / sizeof(Elf32_Phdr) >=
+                header->e_phnum);
+  bool fits = true;  // Every segment inside Jimulator's memory
+  unsigned int extents = 0;
+
+  for (int i = 0; valid && (i < header->e_phnum); i++) {
+    if ((segments[i].p_type == PT_LOAD) && (segments[i].p_memsz > 0)) {
+      valid = (segments[i].p_offset <= length) &&
+              (segments[i].p_filesz <= length - segments[i].p_offset) &&
+              (segments[i].p_filesz <= segments[i].p_memsz);
+      fits = fits && (segments[i].p_paddr < MEMORY_SIZE) &&
+             (segments[i].p_memsz <= MEMORY_SIZE - segments[i].p_paddr);
+      extents++;
+    }
+  }
+
+  if (not valid) {
+    std::cout << "Not an ARM ELF executable!\n";
+    munmap(mapped, length);
+    return false;
+  }
+
+  if (not fits) {  // Checked before anything is sent
+    std::cout << "ELF segment does not fit in memory!\n";
+    munmap(mapped, length);
+    return false;
+  }
+
+  // The header, then each segment's address, length and bytes
+  sendChar(static_cast<unsigned char>(BoardInstruction::SET_MEM_IMAGE));
+  sendNBytes(extents, 4);
+  for (int i = 0; i < header->e_phnum; i++) {
+    const Elf32_Phdr* const segment = &segments[i];
+
+    if ((segment->p_type == PT_LOAD) && (segment->p_memsz > 0)) {
+      sendNBytes(segment->p_paddr, 4);
+      sendNBytes(segment->p_memsz, 4);
+      sendCharArray(segment->p_filesz, image + segment->p_offset);
+
+      // The part not in the file, a chunk at a time
+      static unsigned char zeros[ZERO_FILL_CHUNK];
+      unsigned int left = segment->p_memsz - segment->p_filesz;
+
+      while (left > 0) {
+        const int chunk = std::min(left, (unsigned int)ZERO_FILL_CHUNK);
+
+        sendCharArray(chunk, zeros);
+        left -= chunk;
+      }
+    }
+  }
+
+  sendChar(static_cast<unsigned char>(BoardInstruction::SET_REG));
+  sendNBytes(15, 4);  // The PC, in the current bank
+  sendNBytes(1, 2);   // One register
+  sendNBytes(header->e_entry, 4);
+
+  munmap(mapped, length);
   return true;
 }
 
@@ -1534,6 +1768,18 @@ void initJimulator(std::string argv0) {
   }
 }
 
+static bool isELF(const char *path) {
+	char magic[SELFMAG];
+	FILE *f = fopen(path, "r");
+	bool elf = (f != NULL) && (fread(magic, 1, SELFMAG, f) == SELFMAG) &&
+	           (memcmp(magic, ELFMAG, SELFMAG) == 0);
+
+	if (f != NULL) {
+		fclose(f);
+	}
+	return elf;
+}
+
 static void initTerm() {
 	termios oldt;
 	tcgetattr(0, &oldt);
@@ -1544,14 +1790,21 @@ static void initTerm() {
 	std::cin.setf(std::ios::unitbuf);
 }
 
-static void handle_io() {
+static void handle_io(bool profiling) {
 	char c;
 
-	t1 = new std::thread([&]() -> void {
+	t1 = new std::thread([=]() -> void {
+		bool reported = false;
+
 		while(true) {
 			usleep(10000);
 			mtx.lock();
 			std::cout << Jimulator::getJimulatorTerminalMessages();
+			if (profiling && not reported &&
+			    Jimulator::checkBoardState() == ClientState::FINISHED) {
+				std::cerr << Jimulator::getJimulatorHotSpots(HOT_SPOT_COUNT);
+				reported = true;
+			}
 			mtx.unlock();
 		}
 	});
@@ -1567,22 +1820,36 @@ static void handle_io() {
 }
 
 int main(int argc, char** argv) {
-	if(argc != 2) {
-		std::cout << "usage: " << argv[0] << " <asm file>\n";
+	bool profiling = (argc == 3) && (strcmp(argv[1], "-p") == 0);
+
+	if(argc != 2 && not profiling) {
+		std::cout << "usage: " << argv[0] << " [-p] <asm or ELF file>\n";
 		return 1;
 	}
 
+	char *asm_path = argv[argc - 1];
 	char *kcmd_path = getKcmdPath();
-	char *kmd_path = stokmd(argv[1]);
+	char *kmd_path = NULL;
 
 	*strrchr(kcmd_path, '/') = 0;
 	initJimulator(kcmd_path);
 	initTerm();
-	Jimulator::compileJimulator(kcmd_path, argv[1], kmd_path);
-	
-	Jimulator::loadJimulator(kmd_path);
+	if (isELF(asm_path)) {
+		// Already assembled; loaded as it is
+		if (!Jimulator::loadJimulatorELF(asm_path)) {
+			kill(emulator_PID, SIGTERM);
+			return 1;
+		}
+	} else {
+		kmd_path = stokmd(asm_path);
+		Jimulator::compileJimulator(kcmd_path, asm_path, kmd_path);
+		Jimulator::loadJimulator(kmd_path);
+	}
+	if (profiling) {
+		Jimulator::startProfiling();
+	}
 	Jimulator::startJimulator(1000000);
-	handle_io();
+	handle_io(profiling);
 
 	free(kmd_path);
 	free(kcmd_path);
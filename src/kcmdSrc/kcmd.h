@@ -81,6 +81,7 @@ void compileJimulator(std::string pathToBin,
                       const char* const pathToS,
 		      const char* const pathToKMD);
 const bool loadJimulator(const char* const pathToKMD);
+const bool loadJimulatorELF(const char* const pathToELF);
 
 // ! Sending commands
 
@@ -90,4 +91,9 @@ void pauseJimulator();
 void resetJimulator();
 const bool sendTerminalInputToJimulator(const unsigned int val);
 const bool setBreakpoint(const uint32_t address);
+
+// ! Profiling
+
+void startProfiling();
+const std::string getJimulatorHotSpots(const int count);
 }  // namespace Jimulator
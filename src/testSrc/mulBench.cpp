@@ -0,0 +1,92 @@
+/**
+ * @file mulBench.cpp
+ * @brief Times the long multiply in multiply.h against the old 32x32
+ * decomposition, for each of UMULL, UMLAL, SMULL and SMLAL.
+ */
+
+#include "../jimulatorSrc/multiply.h"
+#include "oldMultiply.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <random>
+#include <vector>
+
+constexpr const int operandCount = 1 << 16;  // A power of 2
+constexpr const long rounds = 1 << 26;       // Multiplies per timing
+
+/**
+ * @brief Seconds on the monotonic clock.
+ */
+double now() {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Time one routine, chaining each result into the next accumulator
+ * so that nothing can be hoisted out of the loop.
+ * @param operands Random words, taken in pairs.
+ * @param multiply The routine, as f(Rm, Rs, accumulator).
+ * @param sink Folded with the final accumulator.
+ * @return Nanoseconds per multiply.
+ */
+template <typename F>
+double timeMultiply(const std::vector<uint32_t>& operands,
+                    F multiply,
+                    uint64_t* sink) {
+  uint64_t acc = 0;
+  const double start = now();
+
+  for (long i = 0; i < rounds; i++) {
+    const int j = (i * 2) & (operandCount - 1);
+
+    acc = multiply(operands[j], operands[j + 1], acc);
+  }
+
+  const double elapsed = now() - start;
+
+  *sink ^= acc;
+  return elapsed * 1e9 / rounds;
+}
+
+int main() {
+  static const char* const names[] = {"UMULL", "SMULL", "UMLAL", "SMLAL"};
+  std::vector<uint32_t> operands(operandCount);
+  std::mt19937 random(1);
+  uint64_t sink = 0;
+
+  for (uint32_t& word : operands)
+    word = random();
+
+  printf("%-6s %10s %10s\n", "", "old ns", "new ns");
+  for (int form = 0; form < 4; form++) {
+    const bool isSigned = (form & 1) != 0;
+    const bool accumulate = (form & 2) != 0;
+
+    const double old = timeMultiply(
+        operands,
+        [=](uint32_t rm, uint32_t rs, uint64_t acc) {
+          const uint64_t result =
+              oldLongMultiply(rm, rs, isSigned, accumulate, (uint32_t)acc,
+                              (uint32_t)(acc >> 32));
+          return result ^ oldLongMultiplyNZ(result);
+        },
+        &sink);
+    const double native = timeMultiply(
+        operands,
+        [=](uint32_t rm, uint32_t rs, uint64_t acc) {
+          const uint64_t result =
+              longMultiply(rm, rs, isSigned, accumulate ? acc : 0);
+          return result ^ longMultiplyNZ(result);
+        },
+        &sink);
+
+    printf("%-6s %10.2f %10.2f\n", names[form], old, native);
+  }
+
+  printf("(checksum %016llX)\n", (unsigned long long)sink);
+  return 0;
+}
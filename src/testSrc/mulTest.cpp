@@ -0,0 +1,172 @@
+/**
+ * @file mulTest.cpp
+ * @brief Checks the long multiplies in multiply.h against the old 32x32
+ * decomposition and a 128-bit model, on edge and random operands, for all of
+ * UMULL, UMLAL, SMULL and SMLAL. MUL (ARM and Thumb) is checked against a
+ * 64-bit model, including products that overflow a signed word. Exits
+ * non-zero on any mismatch.
+ */
+
+#include "../jimulatorSrc/multiply.h"
+#include "oldMultiply.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <random>
+
+/**
+ * @brief The registers a long multiply touches, as in the emulator: RdLo is
+ * written before RdHi, so the high word wins when they are the same register.
+ */
+struct registers {
+  uint32_t r[4];  // Rm, Rs, RdLo, RdHi
+  uint32_t nz;    // What the flags were set from
+};
+
+constexpr const int rdLo = 2;
+constexpr const int rdHi = 3;
+
+static long cases = 0;
+static long failures = 0;
+
+/**
+ * @brief Run one long multiply through the new routine.
+ * @param in The registers before.
+ * @param isSigned SMULL or SMLAL.
+ * @param accumulate UMLAL or SMLAL.
+ * @param hiReg The register RdHi uses: rdHi, or rdLo for RdHi == RdLo.
+ * @return The registers after.
+ */
+registers runNew(registers in,
+                 const bool isSigned,
+                 const bool accumulate,
+                 const int hiReg) {
+  const uint64_t acc =
+      accumulate ? ((uint64_t)in.r[hiReg] << 32) | in.r[rdLo] : 0;
+  const uint64_t result = longMultiply(in.r[0], in.r[1], isSigned, acc);
+
+  in.r[rdLo] = (uint32_t)result;
+  in.r[hiReg] = (uint32_t)(result >> 32);
+  in.nz = longMultiplyNZ(result);
+  return in;
+}
+
+/**
+ * @brief Run one long multiply through the old routine.
+ */
+registers runOld(registers in,
+                 const bool isSigned,
+                 const bool accumulate,
+                 const int hiReg) {
+  const uint64_t result = oldLongMultiply(in.r[0], in.r[1], isSigned,
+                                          accumulate, in.r[rdLo], in.r[hiReg]);
+
+  in.r[rdLo] = (uint32_t)result;
+  in.r[hiReg] = (uint32_t)(result >> 32);
+  in.nz = oldLongMultiplyNZ(result);
+  return in;
+}
+
+/**
+ * @brief Run one long multiply through a 128-bit model.
+ */
+registers runModel(registers in,
+                   const bool isSigned,
+                   const bool accumulate,
+                   const int hiReg) {
+  __int128 product = isSigned ? (__int128)(int32_t)in.r[0] * (int32_t)in.r[1]
+                              : (__int128)in.r[0] * in.r[1];
+
+  if (accumulate)
+    product += (__int128)(((uint64_t)in.r[hiReg] << 32) | in.r[rdLo]);
+
+  const uint64_t result = (uint64_t)product;
+
+  in.r[rdLo] = (uint32_t)result;
+  in.r[hiReg] = (uint32_t)(result >> 32);
+  in.nz = (result >> 63) != 0 ? 0X80000000 : (result != 0);
+  return in;
+}
+
+/**
+ * @brief Whether two runs left the same registers and N and Z flags.
+ */
+bool same(const registers& a, const registers& b) {
+  for (int i = 0; i < 4; i++)
+    if (a.r[i] != b.r[i])
+      return false;
+  return ((a.nz ^ b.nz) & 0X80000000) == 0 && (a.nz == 0) == (b.nz == 0);
+}
+
+/**
+ * @brief Check every form of long multiply on one set of registers.
+ */
+void check(const registers& in) {
+  static const char* const names[] = {"UMULL", "SMULL", "UMLAL", "SMLAL"};
+
+  for (int form = 0; form < 4; form++) {
+    const bool isSigned = (form & 1) != 0;
+    const bool accumulate = (form & 2) != 0;
+
+    for (int hiReg = rdLo; hiReg <= rdHi; hiReg++) {
+      const registers model = runModel(in, isSigned, accumulate, hiReg);
+      const registers now = runNew(in, isSigned, accumulate, hiReg);
+      const registers old = runOld(in, isSigned, accumulate, hiReg);
+
+      cases++;
+      if (!same(model, now) || !same(model, old)) {
+        if (failures++ < 10)
+          printf("%s%s %08X * %08X + %08X:%08X: model %08X:%08X, new "
+                 "%08X:%08X, old %08X:%08X\n",
+                 names[form], hiReg == rdLo ? " (RdHi == RdLo)" : "",
+                 in.r[0], in.r[1], in.r[hiReg], in.r[rdLo], model.r[rdHi],
+                 model.r[rdLo], now.r[rdHi], now.r[rdLo], old.r[rdHi],
+                 old.r[rdLo]);
+      }
+    }
+  }
+}
+
+/**
+ * @brief Check MUL on one pair of operands, as a Thumb MUL Rd, Rm passes them.
+ */
+void checkWord(const uint32_t rd, const uint32_t rm) {
+  const int64_t signedProduct = (int64_t)(int32_t)rm * (int32_t)rd;
+  const uint32_t model = (uint32_t)((uint64_t)rm * rd);
+
+  cases++;
+  if ((wordMultiply(rm, rd) != model) || ((uint32_t)signedProduct != model)) {
+    if (failures++ < 10)
+      printf("MUL %08X * %08X: model %08X, new %08X\n", rm, rd, model,
+             wordMultiply(rm, rd));
+  }
+}
+
+int main() {
+  static const uint32_t edges[] = {0,          1,          2,
+                                   0X0000FFFF, 0X00010000, 0X7FFFFFFF,
+                                   0X80000000, 0X80000001, 0XFFFFFFFE,
+                                   0XFFFFFFFF, 0X12345678};
+  std::mt19937_64 random(1);
+
+  for (uint32_t rm : edges)
+    for (uint32_t rs : edges)
+      for (uint32_t lo : edges)
+        for (uint32_t hi : edges)
+          check({{rm, rs, lo, hi}, 0});
+
+  for (uint32_t rd : edges) /* Many of these overflow a signed word */
+    for (uint32_t rm : edges)
+      checkWord(rd, rm);
+
+  for (long i = 0; i < 2000000; i++) {
+    const uint64_t a = random(), b = random();
+
+    check({{(uint32_t)a, (uint32_t)(a >> 32), (uint32_t)b,
+            (uint32_t)(b >> 32)},
+           0});
+    checkWord((uint32_t)a, (uint32_t)b);
+  }
+
+  printf("%ld multiplies, %ld mismatches\n", cases, failures);
+  return failures != 0;
+}
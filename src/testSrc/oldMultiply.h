@@ -0,0 +1,81 @@
+/**
+ * @file oldMultiply.h
+ * @brief The long multiply as jimulator did it before multiply.h: four 16x16
+ * partial products with hand-propagated carries, the operands made positive
+ * and the result negated for a signed multiply. Kept to check and time the
+ * native 64-bit version against.
+ */
+
+#include <stdint.h>
+
+/**
+ * @brief RdHi:RdLo for a long multiply, by 32x32 decomposition.
+ * @param Rm The first operand.
+ * @param Rs The second operand.
+ * @param isSigned SMULL or SMLAL.
+ * @param accumulate UMLAL or SMLAL.
+ * @param lo The old RdLo.
+ * @param hi The old RdHi.
+ * @return RdHi:RdLo.
+ */
+inline uint64_t oldLongMultiply(uint32_t Rm,
+                                uint32_t Rs,
+                                const bool isSigned,
+                                const bool accumulate,
+                                const uint32_t lo,
+                                const uint32_t hi) {
+  uint32_t th, tm, tl;
+  int sign = 0;
+
+  if (isSigned) {
+    if ((Rm & 0X80000000) != 0) {
+      Rm = ~Rm + 1;
+      sign = 1;
+    }
+    if ((Rs & 0X80000000) != 0) {
+      Rs = ~Rs + 1;
+      sign = sign ^ 1;
+    }
+  }
+  /* Everything now `positive' */
+  tl = (Rm & 0X0000FFFF) * (Rs & 0X0000FFFF);
+  th = ((Rm >> 16) & 0X0000FFFF) * ((Rs >> 16) & 0X0000FFFF);
+  tm = ((Rm >> 16) & 0X0000FFFF) * (Rs & 0X0000FFFF);
+  Rm = ((Rs >> 16) & 0X0000FFFF) * (Rm & 0X0000FFFF); /* Rm no longer needed */
+  tm = tm + Rm;
+  if (tm < Rm)
+    th = th + 0X00010000; /* Propagate carry */
+  tl = tl + (tm << 16);
+  if (tl < (tm << 16))
+    th = th + 1;
+  th = th + ((tm >> 16) & 0X0000FFFF);
+
+  if (sign != 0) { /* Change sign of result */
+    th = ~th;
+    tl = ~tl + 1;
+    if (tl == 0)
+      th = th + 1;
+  }
+
+  if (accumulate) {
+    tm = tl + lo;
+    if (tm < tl)
+      th = th + 1; /* Propagate carry */
+    tl = tm;
+    th = th + hi;
+  }
+
+  return ((uint64_t)th << 32) | tl;
+}
+
+/**
+ * @brief The word the old routine gave setNZ.
+ * @param result RdHi:RdLo.
+ * @return The word.
+ */
+inline uint32_t oldLongMultiplyNZ(const uint64_t result) {
+  const uint32_t th = result >> 32;
+  const uint32_t tl = result;
+
+  return th | (((tl >> 16) | tl) & 0X0000FFFF);
+}
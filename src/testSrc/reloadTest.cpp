@@ -0,0 +1,203 @@
+/**
+ * @file reloadTest.cpp
+ * @brief Runs a program in jimulator, overwrites it through the monitor
+ * interface (a memory write, then a memory image) and runs it again, checking
+ * that the new code is what executes and not a block translated from the old.
+ * Exits non-zero on a failure.
+ * Usage: reloadTest <jimulator>
+ */
+
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+constexpr const uint32_t codeAddress = 0X9000;
+constexpr const uint8_t runFlags = 0X30;  // As kcmd starts a run
+constexpr const uint32_t runSteps = 1000;
+
+static int toJimulator, fromJimulator;
+static pid_t jimulator;
+static int failures = 0;
+
+/**
+ * @brief Start jimulator with its monitor interface on a pair of pipes.
+ * @param path
+ * @return true if it started
+ */
+bool startJimulator(const char* path) {
+  int in[2], out[2];
+
+  if ((pipe(in) != 0) || (pipe(out) != 0)) {
+    return false;
+  }
+
+  jimulator = fork();
+  if (jimulator == 0) {
+    dup2(in[0], 0);
+    dup2(out[1], 1);
+    close(in[1]);
+    close(out[0]);
+    execl(path, path, (char*)NULL);
+    _exit(127);
+  }
+
+  close(in[0]);
+  close(out[1]);
+  toJimulator = in[1];
+  fromJimulator = out[0];
+  return jimulator > 0;
+}
+
+/**
+ * @brief Send bytes to jimulator.
+ * @param data
+ * @param length
+ */
+void sendBytes(const void* data, size_t length) {
+  const uint8_t* p = (const uint8_t*)data;
+
+  while (length > 0) {
+    const ssize_t sent = write(toJimulator, p, length);
+
+    if (sent <= 0) {
+      fprintf(stderr, "jimulator went away\n");
+      _exit(1);
+    }
+    p += sent;
+    length -= sent;
+  }
+}
+
+/**
+ * @brief Send a little-endian value of "n" bytes.
+ */
+void sendN(uint32_t value, int n) {
+  uint8_t buffer[4];
+
+  for (int i = 0; i < n; i++) {
+    buffer[i] = value >> (i * 8);
+  }
+  sendBytes(buffer, n);
+}
+
+/**
+ * @brief Read bytes from jimulator, giving up after ten seconds.
+ */
+void getBytes(void* data, size_t length) {
+  uint8_t* p = (uint8_t*)data;
+
+  while (length > 0) {
+    struct pollfd ready = {fromJimulator, POLLIN, 0};
+    ssize_t got = 0;
+
+    if (poll(&ready, 1, 10000) > 0) {
+      got = read(fromJimulator, p, length);
+    }
+    if (got <= 0) {
+      fprintf(stderr, "no reply from jimulator\n");
+      _exit(1);
+    }
+    p += got;
+    length -= got;
+  }
+}
+
+/**
+ * @brief Write words into memory with one monitor transfer.
+ */
+void writeWords(uint32_t address, const std::vector<uint32_t>& words) {
+  sendN(0X42, 1); /* Memory, word sized */
+  sendN(address, 4);
+  sendN(words.size(), 2);
+  for (uint32_t word : words) {
+    sendN(word, 4);
+  }
+}
+
+/**
+ * @brief Run from codeAddress until the program halts.
+ * @return R0 afterwards
+ */
+uint32_t runProgram() {
+  uint8_t status[9];
+  uint32_t r0;
+
+  sendN(0X52, 1); /* Current registers, write */
+  sendN(15, 4);
+  sendN(1, 2);
+  sendN(codeAddress, 4);
+  sendN(0X80 | runFlags, 1);
+  sendN(runSteps, 4);
+
+  do {
+    struct timespec pause = {0, 1000000};
+
+    nanosleep(&pause, NULL);
+    sendN(0X20, 1); /* BR_WOT_U_DO */
+    getBytes(status, sizeof(status));
+  } while ((status[0] & 0XC0) == 0X80); /* Still running */
+
+  sendN(0X5A, 1); /* Current registers, read */
+  sendN(0, 4);
+  sendN(1, 2);
+  getBytes(&r0, 4);
+  return r0;
+}
+
+/**
+ * @brief The program "MOV R0, #value; SWI 2".
+ */
+std::vector<uint32_t> program(uint8_t value) {
+  return {0XE3A00000 | value, 0XEF000002};
+}
+
+/**
+ * @brief Compare a result with what was expected.
+ */
+void expect(const char* what, uint32_t got, uint32_t wanted) {
+  if (got != wanted) {
+    printf("%s: R0 = %u, expected %u\n", what, got, wanted);
+    failures++;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if ((argc != 2) || !startJimulator(argv[1])) {
+    fprintf(stderr, "Usage: %s <jimulator>\n", argv[0]);
+    return 2;
+  }
+
+  writeWords(codeAddress, program(1));
+  expect("first run", runProgram(), 1);
+
+  /* One write covering far more than the decode cache */
+  std::vector<uint32_t> image(0X10000 / 4, 0);
+  const std::vector<uint32_t> code = program(2);
+
+  std::copy(code.begin(), code.end(), image.begin() + codeAddress / 4);
+  sendN(0X40, 1); /* Memory, byte sized */
+  sendN(0, 4);
+  sendN(0XFFFF, 2);
+  sendBytes(image.data(), 0XFFFF);
+  expect("after one large write", runProgram(), 2);
+
+  /* The same again as a BR_SET_MEM_IMAGE extent */
+  image[codeAddress / 4] = program(3)[0];
+  sendN(0X60, 1);
+  sendN(1, 4); /* Extents */
+  sendN(0, 4);
+  sendN(image.size() * 4, 4);
+  sendBytes(image.data(), image.size() * 4);
+  expect("after a memory image", runProgram(), 3);
+
+  kill(jimulator, SIGKILL);
+  waitpid(jimulator, NULL, 0);
+  printf("reload: %d failures\n", failures);
+  return failures != 0;
+}